@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+# Throughput benchmark. Generates the corpora of bench/corpus.py (once, they are kept for later runs), then runs
+# archive, list and unarchive on every corpus and checks that the extracted files match. Prints one JSON object
+# per line and step, for example to append to a results file and compare runs:
+#
+#   {"corpus": "logs", "step": "archive", "files": 64, "bytes": 268435456, "seconds": 1.93, "mb_per_s": 132.6,
+#    "files_per_s": 33.2, "peak_rss_kb": 14336, "archive_bytes": 31215402, "ratio": 8.6}
+#
+#   make bench
+#   BENCH_CORPORA="tiny logs" make bench      only some corpora
+#   BENCH_SCALE=4 make bench                  four times the files and sizes
+#   BENCH_ARGS="-j4 --io-uring" make bench    extra options for mdarc
+#   BENCH_DIR=/mnt/scratch make bench         work directory, default /tmp/mdarc-corpus
+#
+# Sizes are in bytes of original file data and MB/s is MiB per second, ratio is original size / archive size.
+
+import json
+import os
+import shlex
+import shutil
+import subprocess
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import corpus
+
+MDARC = os.environ.get("MDARC", os.path.abspath("mdarc"))
+PEAK_RSS = os.path.join(os.path.dirname(os.path.abspath(__file__)), "peak_rss")
+BENCH_DIR = os.environ.get("BENCH_DIR", "/tmp/mdarc-corpus")
+SCALE = int(os.environ.get("BENCH_SCALE", "1"))
+CORPORA = os.environ.get("BENCH_CORPORA", " ".join(corpus.CORPORA)).split()
+ARGS = shlex.split(os.environ.get("BENCH_ARGS", ""))
+
+
+def run(args, cwd):
+    # Started through bench/peak_rss, see there why the peak RSS can not be taken from here
+    rss_file = os.path.join(BENCH_DIR, "peak_rss")
+    start = time.monotonic()
+    ret = subprocess.run([PEAK_RSS, rss_file] + args, cwd=cwd, stdout=subprocess.DEVNULL).returncode
+    elapsed = time.monotonic() - start
+    if ret != 0:
+        sys.exit("%s failed with status %d" % (" ".join(args), ret))
+    with open(rss_file) as f:
+        return elapsed, int(f.read())
+
+
+def tree_size(root):
+    files = 0
+    size = 0
+    for path, _, names in os.walk(root):
+        for name in names:
+            files += 1
+            size += os.path.getsize(os.path.join(path, name))
+    return files, size
+
+
+def report(name, step, files, size, elapsed, rss, **extra):
+    result = {"corpus": name, "step": step, "files": files, "bytes": size, "seconds": round(elapsed, 3),
+              "mb_per_s": round(size / elapsed / 1048576, 1) if elapsed > 0 else 0,
+              "files_per_s": round(files / elapsed, 1) if elapsed > 0 else 0, "peak_rss_kb": rss}
+    result.update(extra)
+    print(json.dumps(result), flush=True)
+
+
+def main():
+    scale_dir = os.path.join(BENCH_DIR, "scale%d" % SCALE)
+    for name in CORPORA:
+        if name not in corpus.CORPORA:
+            sys.exit("Unknown corpus %s, available: %s" % (name, " ".join(corpus.CORPORA)))
+        source = os.path.join(scale_dir, name)
+        if not os.path.isdir(source):
+            # Generated under a temporary name, so an interrupted run does not leave an incomplete corpus
+            print("Generating corpus %s" % name, file=sys.stderr)
+            shutil.rmtree(source + ".tmp", ignore_errors=True)
+            corpus.generate(name, source + ".tmp", SCALE)
+            os.rename(source + ".tmp", source)
+        files, size = tree_size(source)
+
+        archive = os.path.join(BENCH_DIR, name + ".arc")
+        out = os.path.join(BENCH_DIR, "out")
+        shutil.rmtree(out, ignore_errors=True)
+        os.makedirs(out)
+
+        elapsed, rss = run([MDARC, "archive", "-r"] + ARGS + [archive, name], scale_dir)
+        archive_size = os.path.getsize(archive)
+        report(name, "archive", files, size, elapsed, rss, archive_bytes=archive_size,
+               ratio=round(size / archive_size, 2) if archive_size > 0 else 0)
+        elapsed, rss = run([MDARC, "unarchive", "-l", archive], out)
+        report(name, "list", files, size, elapsed, rss)
+        elapsed, rss = run([MDARC, "unarchive"] + ARGS + [archive], out)
+        report(name, "unarchive", files, size, elapsed, rss)
+
+        # Not timed: the extracted files must match the corpus
+        if subprocess.run(["diff", "-r", "-q", source, os.path.join(out, name)]).returncode != 0:
+            sys.exit("Extracted files of corpus %s do not match" % name)
+        shutil.rmtree(out)
+        os.remove(archive)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# Compare builds of mdarc on the benchmark corpora. Runs bench/bench.py once for every binary and prints the run
+# time of every corpus and step, with the speedup of each build over the first one:
+#
+#   python3 bench/compare.py mdarc mdarc-release mdarc-pgo
+#   make bench-compare
+#
+# The settings of bench/bench.py (BENCH_CORPORA, BENCH_SCALE, BENCH_ARGS, BENCH_DIR) apply to all runs. The
+# corpora are generated by the first run and shared by the others.
+
+import json
+import os
+import subprocess
+import sys
+
+BENCH = os.path.join(os.path.dirname(os.path.abspath(__file__)), "bench.py")
+
+
+def run_bench(binary):
+    env = dict(os.environ, MDARC=os.path.abspath(binary))
+    print("Running %s" % binary, file=sys.stderr, flush=True)
+    result = subprocess.run([sys.executable, BENCH], env=env, stdout=subprocess.PIPE, text=True)
+    if result.returncode != 0:
+        sys.exit("Benchmark of %s failed" % binary)
+    return {(r["corpus"], r["step"]): r["seconds"] for r in map(json.loads, result.stdout.splitlines())}
+
+
+def main():
+    binaries = sys.argv[1:]
+    if not binaries:
+        sys.exit("Usage: compare.py BINARY [BINARY ...]")
+    results = [run_bench(binary) for binary in binaries]
+
+    header = "%-8s %-10s" % ("corpus", "step")
+    for binary in binaries:
+        header += " %14s" % os.path.basename(binary)
+    print(header)
+    totals = [0.0] * len(binaries)
+    for key in results[0]:
+        line = "%-8s %-10s" % key
+        for i, result in enumerate(results):
+            seconds = result.get(key, 0)
+            totals[i] += seconds
+            line += " %8.3f s" % seconds
+            line += " %4.2fx" % (results[0][key] / seconds) if i > 0 and seconds > 0 else "      "
+        print(line)
+    line = "%-19s" % "total"
+    for i, seconds in enumerate(totals):
+        line += " %8.3f s" % seconds
+        line += " %4.2fx" % (totals[0] / seconds) if i > 0 and seconds > 0 else "      "
+    print(line)
+
+
+if __name__ == "__main__":
+    main()
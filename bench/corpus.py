@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+# Deterministic benchmark corpus generator. Every corpus is generated from a fixed seed, so the same scale always
+# gives byte for byte the same files and benchmark runs can be compared with each other.
+#
+#   python3 bench/corpus.py DIR [--scale N] [corpus ...]
+#
+# Corpora (sizes at scale 1):
+#   tiny     20000 files of 0 - 4 KB of source code like text in 200 directories
+#   huge     2 files of 256 MB, alternating compressible and random 1 MB blocks
+#   random   64 files of 4 MB of incompressible random data
+#   logs     64 files of 4 MB of highly compressible log lines
+#   tree     a wide directory of 5000 files, a tree with 4 subdirectories per level 5 levels deep and a chain of
+#            100 nested directories, with small files everywhere
+
+import argparse
+import os
+import random
+import sys
+
+MB = 1024 * 1024
+WORDS = ("static", "int", "return", "struct", "buffer", "size", "file", "block", "archive", "index", "entry",
+         "length", "offset", "checksum", "thread", "queue", "worker", "error", "while", "if", "else", "for")
+LEVELS = ("INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR")
+SERVICES = ("api", "auth", "billing", "search", "storage", "worker")
+
+
+def random_bytes(rng, size):
+    return rng.getrandbits(8 * size).to_bytes(size, "little") if size > 0 else b""
+
+
+def text_lines(rng, size):
+    out = []
+    total = 0
+    while total < size:
+        line = "    " * rng.randrange(4) + " ".join(rng.choice(WORDS) for _ in range(rng.randrange(2, 12))) + ";\n"
+        out.append(line)
+        total += len(line)
+    return "".join(out).encode()[:size]
+
+
+def log_lines(rng, size, start):
+    out = []
+    total = 0
+    second = start
+    while total < size:
+        second += rng.randrange(3)
+        line = "2024-03-%02d %02d:%02d:%02d %-5s [%s] request id=%d user=%d status=%d duration=%dms\n" % (
+            1 + second // 86400 % 28, second // 3600 % 24, second // 60 % 60, second % 60, rng.choice(LEVELS),
+            rng.choice(SERVICES), rng.randrange(1000000), rng.randrange(5000), rng.choice((200, 200, 200, 404, 500)),
+            rng.randrange(900))
+        out.append(line)
+        total += len(line)
+    return "".join(out).encode()[:size]
+
+
+def write_file(path, data):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def gen_tiny(root, scale, rng):
+    for i in range(20000 * scale):
+        write_file(os.path.join(root, "d%03d" % (i % 200), "f%06d.c" % i), text_lines(rng, rng.randrange(4097)))
+
+
+def gen_huge(root, scale, rng):
+    # One compressible and one random block, repeated with a changing header so blocks are not identical
+    text = text_lines(rng, MB)
+    noise = random_bytes(rng, MB)
+    for i in range(2):
+        path = os.path.join(root, "huge%d.bin" % i)
+        os.makedirs(root, exist_ok=True)
+        with open(path, "wb") as f:
+            for block in range(256 * scale):
+                header = ("%d:%d:" % (i, block)).encode()
+                f.write(header + (text if block % 2 == 0 else noise)[len(header):])
+
+
+def gen_random(root, scale, rng):
+    for i in range(64 * scale):
+        write_file(os.path.join(root, "r%03d.bin" % i), random_bytes(rng, 4 * MB))
+
+
+def gen_logs(root, scale, rng):
+    for i in range(64 * scale):
+        write_file(os.path.join(root, SERVICES[i % len(SERVICES)], "app%03d.log" % i),
+                   log_lines(rng, 4 * MB, i * 86400))
+
+
+def gen_tree(root, scale, rng):
+    for i in range(5000 * scale):
+        write_file(os.path.join(root, "wide", "w%05d.txt" % i), text_lines(rng, rng.randrange(64, 1024)))
+
+    def branch(path, depth):
+        write_file(os.path.join(path, "node.txt"), text_lines(rng, rng.randrange(64, 1024)))
+        if depth < 5:
+            for i in range(4):
+                branch(os.path.join(path, "b%d" % i), depth + 1)
+    for i in range(scale):
+        branch(os.path.join(root, "bushy%d" % i), 0)
+
+    path = os.path.join(root, "deep")
+    for level in range(100):
+        path = os.path.join(path, "level%02d" % level)
+        write_file(os.path.join(path, "file.txt"), text_lines(rng, 256))
+
+
+CORPORA = {"tiny": gen_tiny, "huge": gen_huge, "random": gen_random, "logs": gen_logs, "tree": gen_tree}
+
+
+def generate(name, root, scale):
+    # Every corpus has its own seed, so generating only some of them gives the same files
+    CORPORA[name](root, scale, random.Random("mdarc-%s-%d" % (name, scale)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate the mdarc benchmark corpora")
+    parser.add_argument("dir")
+    parser.add_argument("--scale", type=int, default=1, help="multiply file counts and sizes")
+    parser.add_argument("corpora", nargs="*", default=list(CORPORA))
+    args = parser.parse_args()
+
+    for name in args.corpora:
+        if name not in CORPORA:
+            sys.exit("Unknown corpus %s, available: %s" % (name, " ".join(CORPORA)))
+        generate(name, os.path.join(args.dir, name), args.scale)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Large file regression benchmark. Generates sparse files of 8 GB and 64 GB with data regions spread over the
+# whole file (also past the 2 and 4 GB marks), archives, tests and extracts them and checks that they come back
+# unchanged. Prints the throughput and peak RSS of every step.
+#
+#   make bench-large
+#   BENCH_SIZES="8" make bench-large             only the 8 GB file
+#   BENCH_DIR=/mnt/scratch make bench-large      work directory, needs room for the data regions three times
+#   BENCH_STRIDE=4 make bench-large              1 MB of data every 4 MB (default 8), more data to compress
+
+set -e
+
+MDARC=${MDARC:-$(pwd)/mdarc}
+BENCH_DIR=${BENCH_DIR:-/tmp/mdarc-bench}
+BENCH_SIZES=${BENCH_SIZES:-"8 64"}
+BENCH_STRIDE=${BENCH_STRIDE:-8}
+
+# Run a command and print its run time, throughput over the given number of bytes and peak RSS
+measure()
+{
+    python3 -c '
+import resource, subprocess, sys, time
+label, size = sys.argv[1], int(sys.argv[2])
+start = time.monotonic()
+ret = subprocess.run(sys.argv[3:], stdout=subprocess.DEVNULL).returncode
+elapsed = time.monotonic() - start
+rss = resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss / 1024
+rate = size / elapsed / 1048576 if elapsed > 0 else 0
+print("%-22s %8.2f s %10.1f MB/s %8.1f MB peak RSS" % (label, elapsed, rate, rss))
+sys.exit(ret)
+' "$@"
+}
+
+rm -rf "$BENCH_DIR"
+mkdir -p "$BENCH_DIR/in" "$BENCH_DIR/out"
+
+# 1 MB of sample data, half random and half text, repeated in every data region
+head -c 524288 /dev/urandom > "$BENCH_DIR/chunk"
+yes "mdarc large file benchmark, sample text line" | head -c 524288 >> "$BENCH_DIR/chunk"
+
+for size in $BENCH_SIZES
+do
+    file="$BENCH_DIR/in/large_${size}g.img"
+    bytes=$((size * 1024 * 1024 * 1024))
+    echo "== ${size} GB file, 1 MB of data every ${BENCH_STRIDE} MB"
+
+    truncate -s "${size}G" "$file"
+    mb=0
+    while [ "$mb" -lt $((size * 1024)) ]
+    do
+        dd if="$BENCH_DIR/chunk" of="$file" bs=1M seek="$mb" conv=notrunc status=none
+        mb=$((mb + BENCH_STRIDE))
+    done
+
+    cd "$BENCH_DIR/in"
+    measure "archive" "$bytes" "$MDARC" archive "$BENCH_DIR/large.arc" "large_${size}g.img"
+    measure "test" "$bytes" "$MDARC" test "$BENCH_DIR/large.arc"
+    cd "$BENCH_DIR/out"
+    measure "unarchive" "$bytes" "$MDARC" unarchive "$BENCH_DIR/large.arc"
+
+    cmp "$file" "$BENCH_DIR/out/large_${size}g.img"
+    echo "archive size $(du -k "$BENCH_DIR/large.arc" | cut -f1) KB," \
+         "extracted file uses $(du -k "$BENCH_DIR/out/large_${size}g.img" | cut -f1) KB on disk, contents match"
+    rm -f "$file" "$BENCH_DIR/large.arc" "$BENCH_DIR/out/large_${size}g.img"
+done
+
+rm -rf "$BENCH_DIR"
@@ -0,0 +1,53 @@
+// Run a command and write its peak RSS in KB to a file, for bench/bench.py. A forked child starts with the RSS
+// high-water mark of its parent, so the command is started from this small program instead of the Python
+// benchmark itself, which would otherwise be counted as well.
+//
+//   peak_rss OUTPUT_FILE COMMAND [ARGS...]
+//
+// Exits with the exit status of the command, or 127 if it could not be started.
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: peak_rss OUTPUT_FILE COMMAND [ARGS...]\n");
+        return 127;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Error starting command");
+        return 127;
+    }
+    if (pid == 0)
+    {
+        execvp(argv[2], argv + 2);
+        perror("Error starting command");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+    {
+        perror("Error waiting for command");
+        return 127;
+    }
+
+    FILE *out = fopen(argv[1], "w");
+    if (!out)
+    {
+        perror("Error writing peak RSS");
+        return 127;
+    }
+    fprintf(out, "%ld\n", usage.ru_maxrss);
+    fclose(out);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
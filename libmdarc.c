@@ -0,0 +1,6059 @@
+#include "mdarc_internal.h"
+
+// Functions used only in this file. The functions the command line program calls are declared in mdarc_internal.h
+static int write_archive(Options *opts, CompressQueue *queue, FILE *archive);
+static void init_compress_queue(CompressQueue *queue, Options *opts);
+static void *compress_worker(void *arg);
+static int compress_file(CompressQueue *queue, FileNode *node, z_stream *stream);
+static uint32_t compress_block(z_stream *stream, const unsigned char *data, uint32_t len,
+                               unsigned char *compressed_block);
+static int decompress_block(z_stream *stream, const unsigned char *compressed_block, uint32_t len, unsigned char *block,
+                            uint32_t original_len);
+static z_stream *deflate_stream_init(z_stream *stream);
+static z_stream *inflate_stream_init(z_stream *stream);
+static void pool_init(BufferPool *pool, size_t buffer_size);
+static void *pool_get(BufferPool *pool);
+static void pool_put(BufferPool *pool, void *buffer);
+static void pool_free(BufferPool *pool);
+static void free_payload(CompressQueue *queue, FileNode *node);
+static int block_reader_open(BlockReader *reader, FileNode *node);
+static int read_next_block(BlockReader *reader, unsigned char *block, const unsigned char **data, size_t *len,
+                           uint64_t *hole_len);
+static void block_reader_close(BlockReader *reader);
+#if HAVE_IO_URING
+static void *io_uring_reader(void *arg);
+static int read_batch(CompressQueue *queue, ReadAheadSlot *slots, unsigned int count);
+static int io_ring_init(IoRing *ring, unsigned int entries);
+static void io_ring_free(IoRing *ring);
+static struct io_uring_sqe *io_ring_get_sqe(IoRing *ring);
+static unsigned int io_ring_collect(IoRing *ring, int *results);
+static int io_ring_run(IoRing *ring, int *results);
+#endif
+static int reserve_payload(CompressQueue *queue, FileNode *node, z_stream *stream, size_t len);
+static int append_block(CompressQueue *queue, FileNode *node, z_stream *stream, const unsigned char *data, uint32_t len,
+                        uint32_t original_len);
+static int append_hole(CompressQueue *queue, FileNode *node, z_stream *stream, uint64_t len);
+static void reserve_memory(CompressQueue *queue, FileNode *node, z_stream *stream, uint64_t bytes);
+static bool try_reserve_memory(CompressQueue *queue, uint64_t bytes);
+static void reserve_added_memory(CompressQueue *queue, uint64_t bytes);
+static void release_memory(CompressQueue *queue, uint64_t bytes);
+static void print_memory_peak(uint64_t peak, uint64_t limit);
+static int add_file_to_archive(ArchiveStream *out, FileNode *node);
+static int stream_file_to_archive(ArchiveStream *out, CompressQueue *queue, FileNode *node, z_stream *stream,
+                                  bool *incomplete);
+static int alloc_stream_slots(CompressQueue *queue);
+static void free_stream_slots(CompressQueue *queue);
+static void compress_stream_slot(CompressQueue *queue, uint64_t seq, z_stream *stream);
+static int write_stream_slot(ArchiveStream *out, FileNode *node, StreamSlot *slot);
+static int compare_grep_offset(const void *a, const void *b);
+static int grep_parallel(GrepQueue *queue, bool *matched);
+static void *grep_worker(void *arg);
+static int grep_sequential(ArchiveStream *in, Options *opts, bool *matched);
+static int grep_worker_init(GrepWorker *worker, Options *opts, FILE *file);
+static void grep_worker_free(GrepWorker *worker);
+static int grep_entry(GrepWorker *worker, GrepEntry *entry);
+static int grep_block(GrepWorker *worker, GrepEntry *entry, const char *data, size_t len);
+static int grep_lines(GrepWorker *worker, GrepEntry *entry, const char *data, size_t len);
+static int append_carry(GrepWorker *worker, const char *data, size_t len);
+static int append_output(GrepEntry *entry, const char *data, size_t len);
+static bool is_member_selected(const Options *opts, const char *file_path);
+static int open_archive(const char *archive_name, ArchiveStream *in);
+static int decode_archive(ArchiveStream *in, Options *opts, DecodeMode mode, DecodeTotals *totals);
+static void *decode_worker(void *arg);
+static void decode_block(DecodeQueue *queue, DecodeJob *job, unsigned char *block, z_stream *stream);
+static int queue_entry_blocks(ArchiveStream *in, DecodeQueue *queue, DecodeEntry *entry, bool skip);
+static int add_hole_block(DecodeQueue *queue, DecodeEntry *entry, uint32_t len);
+static int grow_entry_blocks(DecodeEntry *entry);
+static void set_entry_error(DecodeQueue *queue, DecodeEntry *entry, const char *error);
+static void release_entry(DecodeQueue *queue, DecodeEntry *entry);
+static int skip_entry_data(ArchiveStream *in);
+static int write_entry_data(ArchiveStream *in, FILE *out, unsigned char *block, unsigned char *compressed_block,
+                            z_stream *stream);
+static int read_data_block(ArchiveStream *in, unsigned char *block, unsigned char *compressed_block, z_stream *stream,
+                           uint32_t *original_len, uint32_t *len);
+static int check_data_descriptor(ArchiveStream *in, uint64_t original_size, uint64_t compressed_size,
+                                 uint32_t checksum);
+static int open_entry_file(DirCache *dirs, DecodeEntry *entry, uint64_t size, bool direct_io, bool sparse);
+static int create_output_file(OutputFile *out, int dir_fd, const char *name, uint64_t size, bool direct_io,
+                              bool sparse);
+static int write_output(OutputFile *out, const unsigned char *data, size_t len, uint64_t offset);
+static int close_output_file(OutputFile *out, uint64_t size);
+static bool is_safe_path(const char *file_path);
+static int validate_file_path(DirCache *cache, const char *file_path, int *dir_fd);
+static int get_directory(DirCache *cache, const char *path, size_t len);
+static DirCacheEntry *dir_cache_find(DirCache *cache, const char *path, size_t len);
+static DirCacheEntry *dir_cache_insert(DirCache *cache, const char *path, size_t len);
+static int dir_cache_init(DirCache *cache);
+static void dir_cache_close_fds(DirCache *cache);
+static void dir_cache_free(DirCache *cache);
+
+static int write_archive_header(ArchiveStream *out);
+static int read_archive_header(ArchiveStream *in);
+static int write_archive_index(ArchiveStream *out, Options *opts);
+static int write_index_block(ArchiveStream *out, FileNode **entries, uint32_t count, IndexBlock *block,
+                             unsigned char **buffer, size_t *capacity);
+static int list_archive_index(ArchiveStream *in, const char *prefix);
+static int find_prefix_entries(ArchiveStream *in, const char *prefix, uint64_t **offsets, size_t *count);
+static int index_lower_bound(ArchiveIndex *index, const char *file_path, uint32_t *block, uint32_t *entry);
+static int compare_u64(const void *a, const void *b);
+static int compare_list_index(const void *a, const void *b);
+static int open_archive_index(ArchiveStream *in, ArchiveIndex *index);
+static void close_archive_index(ArchiveIndex *index);
+static int grow_index_buffer(void **buffer, size_t *capacity, size_t size);
+static int load_index_block(ArchiveIndex *index, uint32_t block);
+static int find_index_block(ArchiveIndex *index, const char *file_path, uint32_t *block);
+static int find_index_entry(ArchiveIndex *index, const char *file_path, IndexEntry **entry);
+static int compare_index_path(const char *a, const char *b);
+static int compare_index_order(const void *a, const void *b);
+static bool same_directory(const char *a, const char *b);
+static int read_entry_header(ArchiveStream *in, char *file_path, uint64_t *original_size, uint16_t *flags);
+static int write_bytes(ArchiveStream *out, const void *data, size_t len);
+static int read_bytes(ArchiveStream *in, void *data, size_t len);
+static int skip_bytes(ArchiveStream *in, uint64_t len);
+static int close_archive(FILE *archive);
+static uint32_t crc32c(uint32_t crc, const unsigned char *data, size_t len);
+static void crc32c_init(void);
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *data, size_t len);
+#if HAVE_CRC32C_SSE42
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len);
+#endif
+static TraceBuffer *trace_get_buffer(void);
+static void trace_label(const char *label);
+static void progress_add(uint64_t files, uint64_t bytes);
+static int progress_start(ProgressReporter *reporter, Options *opts);
+static void progress_stop(ProgressReporter *reporter);
+static void *progress_reporter(void *arg);
+static void print_progress(ProgressReporter *reporter, double rate, bool last);
+static void write_json_string(FILE *out, const char *text);
+static uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+static uint32_t crc32c_append_zeros(uint32_t crc, uint64_t len);
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc);
+static void crc32c_zeros(uint32_t zeros[][256], size_t len);
+static void crc32c_zeros_op(uint32_t *even, size_t len);
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec);
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat);
+static void put_u16(unsigned char *buf, uint16_t value);
+static void put_u32(unsigned char *buf, uint32_t value);
+static void put_u64(unsigned char *buf, uint64_t value);
+static uint16_t get_u16(const unsigned char *buf);
+static uint32_t get_u32(const unsigned char *buf);
+static uint64_t get_u64(const unsigned char *buf);
+
+static int add_path_to_list(const char *path, Options *opts);
+static void *read_list_file(void *arg);
+static int add_file_to_list(Options *opts, char *file_path, uint64_t size, unsigned char *data);
+static char *make_archive_path(const char *file_path, bool *stripped);
+static MdarcWriter *writer_open(FILE *archive, const MdarcWriterOptions *options);
+static void *writer_thread(void *arg);
+static int reader_extract(MdarcReader *reader, const MdarcEntry *entry, FILE *out);
+static void reader_set_entry(MdarcReader *reader, const IndexEntry *index_entry, MdarcEntry *entry);
+static int traverse_directory(const char *dir_path, Options *opts);
+static int sort_by_location(Options *opts);
+static void get_file_location(FileLocation *location, bool use_extent);
+static int compare_locations(const void *a, const void *b);
+
+static bool match_pattern(const Pattern *pat, const char *path, const char *name, bool is_dir);
+static bool is_filtered_out(const Options *opts, const char *path, bool is_dir);
+static void free_patterns(PatternList *list);
+
+// CRC32C lookup tables, set up once by crc32c_init()
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_block[4][256];
+#if HAVE_CRC32C_SSE42
+static bool crc32c_use_sse42;
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+#endif
+
+// --stats counters. Global like the CRC tables, so the low level read/write helpers can count without an Options
+bool mdarc_stats_enabled;
+static PhaseStats phase_stats[STAT_PHASES];
+static const char *phase_names[STAT_PHASES] =
+{
+    "walk", "open/stat", "read files", "checksum", "compress", "write archive", "read archive", "inflate", "mkdir",
+    "create files", "write files"
+};
+
+// --trace event rings, one per running thread that recorded an event. trace_buffer is the ring of the calling thread,
+// trace_key gives it back when the thread exits
+bool mdarc_trace_enabled;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static bool trace_key_created;
+static TraceBuffer *trace_buffers;
+static unsigned int trace_thread_count;
+static bool trace_alloc_failed;
+static bool trace_limit_reached;
+static __thread TraceBuffer *trace_buffer;
+static __thread bool trace_no_buffer;
+
+// --progress counters, added to with relaxed atomics by the threads doing the work and read by the reporter
+bool mdarc_progress_enabled;
+static uint64_t progress_files;
+static uint64_t progress_bytes;
+
+
+
+int mdarc_archive_files(Options *opts)
+{
+    // OPEN archive file in write binary mode, "-" writes the archive to stdout
+    FILE *archive;
+    if (strcmp(opts->archive_name, "-") == 0)
+    {
+        if (isatty(STDOUT_FILENO))
+        {
+            fprintf(stderr, "Error: refusing to write archive to a terminal\n");
+            return 1;
+        }
+        archive = stdout;
+    }
+    else
+    {
+        archive = fopen(opts->archive_name, "wb");
+    }
+
+    // Check if archive file opened correctly
+    if (!archive)
+    {
+        perror("Error creating archive");
+        return 1;
+    }
+    CompressQueue queue;
+    init_compress_queue(&queue, opts);
+    return write_archive(opts, &queue, archive);
+}
+
+
+// Compress the files of opts->file_list and write them to archive, which is closed at the end. The list can
+// still grow while this runs (-T, library writers) until opts->list_complete is set. queue is set up by
+// init_compress_queue()
+static int write_archive(Options *opts, CompressQueue *queue, FILE *archive)
+{
+    // Keep reading the -T manifest in the background, workers start on the entries already listed
+    pthread_t list_thread;
+    bool list_thread_started = false;
+    if (opts->list_stream)
+    {
+        if (pthread_create(&list_thread, NULL, read_list_file, opts) != 0)
+        {
+            perror("Error starting file list reader");
+            close_archive(archive);
+            return 1;
+        }
+        list_thread_started = true;
+    }
+
+    // Sorting by physical location needs the complete list, so the -T manifest is read to the end first
+    if (opts->read_order != READ_ORDER_LIST)
+    {
+        if (list_thread_started)
+        {
+            pthread_join(list_thread, NULL);
+            list_thread_started = false;
+        }
+        sort_by_location(opts);
+    }
+
+    // Start the io_uring reader, falling back to the regular reads if io_uring is not available
+    pthread_t reader_thread;
+    if (opts->io_uring)
+    {
+#if HAVE_IO_URING
+        if (io_ring_init(&queue->ring, 2 * IO_BATCH_SIZE) == 0)
+        {
+            if (pthread_create(&reader_thread, NULL, io_uring_reader, queue) == 0)
+            {
+                queue->use_read_ahead = true;
+            }
+            else
+            {
+                io_ring_free(&queue->ring);
+            }
+        }
+#endif
+        if (!queue->use_read_ahead)
+        {
+            fprintf(stderr, "Warning: io_uring not available, using regular file reads\n");
+        }
+    }
+
+    // Progress is reported from a thread of its own, so a stalled pipeline still gets its updates
+    ProgressReporter reporter;
+    bool reporter_started = mdarc_progress_enabled && progress_start(&reporter, opts) == 0;
+
+    // Start the compression workers
+    pthread_t *workers = malloc(opts->threads * sizeof(pthread_t));
+    unsigned int worker_count = 0;
+    if (!workers)
+    {
+        perror("Error allocating memory for worker threads");
+    }
+    else
+    {
+        while (worker_count < opts->threads)
+        {
+            if (pthread_create(&workers[worker_count], NULL, compress_worker, queue) != 0)
+            {
+                perror("Error starting compression worker");
+                break;
+            }
+            worker_count++;
+        }
+    }
+    if (worker_count == 0)
+    {
+        fprintf(stderr, "Error: no compression workers available. Archive not written\n");
+        queue->max_in_flight = 0; // Nothing gets compressed, only wait for the list reader below
+    }
+
+    ArchiveStream out = { .file = archive };
+    bool write_failed = write_archive_header(&out) != 0;
+    z_stream writer_deflate;
+    z_stream *writer_stream = deflate_stream_init(&writer_deflate); // Compresses stream blocks while waiting
+    bool entry_failed = false;
+
+    // Iterate through file list in order and write every compressed file to archive
+    FileNode *current = NULL;
+    while (worker_count > 0)
+    {
+        // Wait until the next entry is listed and compressed, or the list is complete
+        uint64_t start = mdarc_stats_clock();
+        bool waited = false;
+        pthread_mutex_lock(&opts->list_lock);
+        FileNode *next = current ? current->next : opts->file_list;
+        while ((next == NULL && !opts->list_complete) || (next != NULL && next->status == ENTRY_PENDING))
+        {
+            pthread_cond_wait(&opts->list_changed, &opts->list_lock);
+            next = current ? current->next : opts->file_list;
+            waited = true;
+        }
+        pthread_mutex_unlock(&opts->list_lock);
+
+        if (next == NULL)
+        {
+            break;
+        }
+        current = next;
+
+        // The time the writer stalled on this entry shows up as a wait span before its write
+        trace_label(current->file_name);
+        if (waited)
+        {
+            mdarc_trace_span("wait", start, mdarc_stats_clock());
+        }
+        start = mdarc_stats_clock();
+
+        // After a write error the remaining entries are only drained, so the workers can finish
+        entry_failed |= current->status == ENTRY_FAILED;
+        if (current->status == ENTRY_READY && !write_failed)
+        {
+            int ret = current->stream ? stream_file_to_archive(&out, queue, current, writer_stream, &entry_failed)
+                                      : add_file_to_archive(&out, current);
+            if (ret == 0)
+            {
+                current->status = ENTRY_WRITTEN;
+            }
+            else if (ret == 2) // Streamed file could not be opened, nothing was written
+            {
+                entry_failed = true;
+            }
+            else
+            {
+                write_failed = true;
+            }
+            mdarc_trace_span("write entry", start, mdarc_stats_clock());
+        }
+        free_payload(queue, current);
+        progress_add(1, 0);
+
+        // Free a slot for the workers
+        pthread_mutex_lock(&opts->list_lock);
+        queue->last_written = current;
+        queue->in_flight--;
+        pthread_cond_broadcast(&opts->list_changed);
+        pthread_mutex_unlock(&opts->list_lock);
+    }
+
+    // Let the workers exit once the list is handed out
+    pthread_mutex_lock(&opts->list_lock);
+    queue->writer_done = true;
+    pthread_cond_broadcast(&opts->list_changed);
+    pthread_mutex_unlock(&opts->list_lock);
+    for (unsigned int i = 0; i < worker_count; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    if (writer_stream)
+    {
+        deflateEnd(writer_stream);
+    }
+#if HAVE_IO_URING
+    if (queue->use_read_ahead)
+    {
+        pthread_join(reader_thread, NULL);
+        io_ring_free(&queue->ring);
+    }
+    pool_free(&queue->read_pool);
+#endif
+    pool_free(&queue->block_pool);
+    pool_free(&queue->payload_pool);
+    if (list_thread_started)
+    {
+        pthread_join(list_thread, NULL);
+    }
+    if (reporter_started)
+    {
+        progress_stop(&reporter);
+    }
+    if (opts->max_memory > 0)
+    {
+        print_memory_peak(queue->memory_peak, opts->max_memory);
+    }
+
+    // Finish the archive with the index of all written entries
+    if (!write_failed)
+    {
+        write_failed = write_archive_index(&out, opts) != 0;
+    }
+    if (close_archive(archive) != 0 && !write_failed)
+    {
+        perror("Error writing archive");
+        write_failed = true;
+    }
+    return write_failed || entry_failed || opts->list_failed || worker_count == 0;
+}
+
+
+// Set up the queue of write_archive() for opts->threads workers and opts->max_memory. Library writers do this
+// before the writer starts, so entries added from memory can be counted in it
+static void init_compress_queue(CompressQueue *queue, Options *opts)
+{
+    *queue = (CompressQueue) { .opts = opts, .max_in_flight = opts->threads * QUEUE_DEPTH_PER_THREAD };
+
+    // A payload buffer holds the compressed block of a small file and the block headers around it
+    size_t payload_buffer_size = compressBound(DATA_BLOCK_SIZE) + 2 * BLOCK_HEADER_SIZE;
+    payload_buffer_size = (payload_buffer_size + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    pool_init(&queue->block_pool, DATA_BLOCK_SIZE);
+    pool_init(&queue->payload_pool, payload_buffer_size);
+#if HAVE_IO_URING
+    pool_init(&queue->read_pool, READ_AHEAD_MAX_SIZE + DIRECT_IO_ALIGN);
+#endif
+
+    // Split --max-memory: the entry the writer needs next never waits, so room for it is kept free of the other
+    // entries. That is either a file compressed in memory or the stream ring, never both at once. Files that would
+    // take more than a quarter of the budget are streamed
+    queue->stream_min_size = STREAM_MIN_SIZE;
+    queue->stream_slot_count = 2 * opts->threads;
+    if (opts->max_memory > 0)
+    {
+        uint64_t quarter = opts->max_memory / 4;
+        uint64_t slot_size = DATA_BLOCK_SIZE + payload_buffer_size;
+        if (quarter < STREAM_MIN_SIZE)
+        {
+            queue->stream_min_size = quarter > DATA_BLOCK_SIZE ? quarter : DATA_BLOCK_SIZE;
+        }
+        if (queue->stream_slot_count * slot_size > 2 * quarter)
+        {
+            queue->stream_slot_count = 2 * quarter / slot_size > 0 ? 2 * quarter / slot_size : 1;
+        }
+        uint64_t entry_size = DATA_BLOCK_SIZE + 2 * (queue->stream_min_size + payload_buffer_size); // Payload doubles
+        uint64_t ring_size = queue->stream_slot_count * slot_size;
+        uint64_t reserved = entry_size > ring_size ? entry_size : ring_size;
+        queue->worker_memory = opts->max_memory > reserved ? opts->max_memory - reserved : 0;
+    }
+}
+
+
+// Compression worker thread. Takes the next entry of the file list, waiting for the list to grow if necessary,
+// and compresses it in memory. At most max_in_flight entries are held ahead of the archive writer
+static void *compress_worker(void *arg)
+{
+    CompressQueue *queue = arg;
+    Options *opts = queue->opts;
+    z_stream deflate_state;
+    z_stream *stream = deflate_stream_init(&deflate_state);
+    mdarc_trace_thread("compress worker");
+
+    while (true)
+    {
+        // Blocks of a streamed file come first, the writer is waiting for them. Until the writer is done, a
+        // large file at the end of the list can still need the workers
+        pthread_mutex_lock(&opts->list_lock);
+        FileNode *node = queue->last_claimed ? queue->last_claimed->next : opts->file_list;
+        while (queue->stream_taken == queue->stream_read &&
+               ((node == NULL && !(opts->list_complete && queue->writer_done)) ||
+                (node != NULL && queue->in_flight >= queue->max_in_flight) ||
+                (node != NULL && queue->use_read_ahead && node->read_ahead == READ_AHEAD_PENDING)))
+        {
+            pthread_cond_wait(&opts->list_changed, &opts->list_lock);
+            node = queue->last_claimed ? queue->last_claimed->next : opts->file_list;
+        }
+        if (queue->stream_taken < queue->stream_read)
+        {
+            uint64_t seq = queue->stream_taken++;
+            pthread_mutex_unlock(&opts->list_lock);
+            compress_stream_slot(queue, seq, stream);
+            continue;
+        }
+        if (node == NULL) // Whole list handed out
+        {
+            pthread_mutex_unlock(&opts->list_lock);
+            if (stream)
+            {
+                deflateEnd(stream);
+            }
+            return NULL;
+        }
+        queue->last_claimed = node;
+        queue->in_flight++;
+#if HAVE_IO_URING
+        if (queue->use_read_ahead)
+        {
+            queue->read_ahead--;
+            pthread_cond_broadcast(&opts->list_changed); // Room for the io_uring reader
+        }
+#endif
+        pthread_mutex_unlock(&opts->list_lock);
+
+        uint64_t start = mdarc_stats_clock();
+        trace_label(node->file_name);
+        EntryStatus status = compress_file(queue, node, stream) == 0 ? ENTRY_READY : ENTRY_FAILED;
+        mdarc_trace_span("compress entry", start, mdarc_stats_clock());
+
+        pthread_mutex_lock(&opts->list_lock);
+        node->status = status;
+        pthread_cond_broadcast(&opts->list_changed);
+        pthread_mutex_unlock(&opts->list_lock);
+    }
+}
+
+
+#if HAVE_IO_URING
+// Read-ahead thread for --io-uring. Takes batches of files from the file list ahead of the compression workers and
+// opens, stats, reads and closes all files of a batch with a few io_uring submissions, instead of several system
+// calls per file. Files that can not be read this way are left to the regular stdio path in compress_file()
+static void *io_uring_reader(void *arg)
+{
+    CompressQueue *queue = arg;
+    Options *opts = queue->opts;
+    ReadAheadSlot slots[IO_BATCH_SIZE];
+    bool ring_ok = true;
+    mdarc_trace_thread("io_uring reader");
+
+    while (true)
+    {
+        // Wait for files that are not read yet, without getting too far ahead of the workers
+        pthread_mutex_lock(&opts->list_lock);
+        FileNode *node = queue->last_read ? queue->last_read->next : opts->file_list;
+        while ((node == NULL && !opts->list_complete) || (node != NULL && queue->read_ahead >= MAX_READ_AHEAD))
+        {
+            pthread_cond_wait(&opts->list_changed, &opts->list_lock);
+            node = queue->last_read ? queue->last_read->next : opts->file_list;
+        }
+        if (node == NULL) // Whole list read
+        {
+            pthread_mutex_unlock(&opts->list_lock);
+            return NULL;
+        }
+
+        // Take as many files as are listed already, up to a full batch
+        unsigned int count = 0;
+        while (node != NULL && count < IO_BATCH_SIZE && queue->read_ahead + count < MAX_READ_AHEAD)
+        {
+            slots[count++].node = node;
+            queue->last_read = node;
+            node = node->next;
+        }
+        pthread_mutex_unlock(&opts->list_lock);
+
+        // After the ring failed the files are handed over unread, the workers read them the regular way
+        if (ring_ok && read_batch(queue, slots, count) != 0)
+        {
+            fprintf(stderr, "Warning: io_uring failed, using regular file reads for the remaining files\n");
+            io_ring_free(&queue->ring);
+            ring_ok = false;
+        }
+        else if (!ring_ok)
+        {
+            for (unsigned int i = 0; i < count; i++)
+            {
+                slots[i].data = NULL;
+                slots[i].len = 0;
+            }
+        }
+
+        // Hand the batch over to the compression workers
+        pthread_mutex_lock(&opts->list_lock);
+        for (unsigned int i = 0; i < count; i++)
+        {
+            slots[i].node->read_ahead = slots[i].data ? READ_AHEAD_DATA : READ_AHEAD_SKIPPED;
+            slots[i].node->read_data = slots[i].data;
+            slots[i].node->read_pooled = true;
+            slots[i].node->read_len = slots[i].len;
+        }
+        queue->read_ahead += count;
+        pthread_cond_broadcast(&opts->list_changed);
+        pthread_mutex_unlock(&opts->list_lock);
+    }
+}
+
+
+// Read a batch of small files in three io_uring round trips: openat + statx, read, close. The file data goes into
+// buffers of the read pool, compress_file() hands them back. Files that do not fit into --max-memory are left to the
+// workers. Returns 1 if the ring failed, the files of the batch are then all left to the workers and the ring must
+// not be used anymore
+static int read_batch(CompressQueue *queue, ReadAheadSlot *slots, unsigned int count)
+{
+    IoRing *ring = &queue->ring;
+    BufferPool *pool = &queue->read_pool;
+    int results[2 * IO_BATCH_SIZE];
+
+    // Entries that never complete keep this result, so nothing is taken for an opened file or a finished read
+    for (unsigned int i = 0; i < 2 * IO_BATCH_SIZE; i++)
+    {
+        results[i] = -ECANCELED;
+    }
+
+    // Open and stat every file of the batch
+    uint64_t start = mdarc_stats_clock();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        slots[i].fd = -1;
+        slots[i].data = NULL;
+        slots[i].len = 0;
+
+        struct io_uring_sqe *sqe = io_ring_get_sqe(ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) slots[i].node->file_name;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = 2 * i;
+
+        sqe = io_ring_get_sqe(ring);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) slots[i].node->file_name;
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (uintptr_t) &slots[i].stx;
+        sqe->user_data = 2 * i + 1;
+    }
+    int ret = io_ring_run(ring, results);
+    mdarc_stats_add(STAT_OPEN, start, count, 0);
+    if (ret != 0)
+    {
+        // Close the files opened before the ring failed, all files go through the regular path
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (results[2 * i] >= 0)
+            {
+                close(results[2 * i]);
+            }
+        }
+        return 1;
+    }
+
+    // Read every small regular file in one go. One byte more than the size is requested to notice growing files
+    for (unsigned int i = 0; i < count; i++)
+    {
+        slots[i].fd = results[2 * i];
+        if (slots[i].fd < 0 || results[2 * i + 1] != 0 || !S_ISREG(slots[i].stx.stx_mode) ||
+            slots[i].stx.stx_size > READ_AHEAD_MAX_SIZE)
+        {
+            continue;
+        }
+        if (!try_reserve_memory(queue, pool->buffer_size))
+        {
+            continue;
+        }
+        slots[i].data = pool_get(pool);
+        if (!slots[i].data)
+        {
+            release_memory(queue, pool->buffer_size);
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = io_ring_get_sqe(ring);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = slots[i].fd;
+        sqe->addr = (uintptr_t) slots[i].data;
+        sqe->len = slots[i].stx.stx_size + 1;
+        sqe->off = 0;
+        sqe->user_data = i;
+    }
+    start = mdarc_stats_clock();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        results[i] = -ECANCELED;
+    }
+    bool read_ok = io_ring_run(ring, results) == 0;
+    uint64_t batch_files = 0;
+    uint64_t batch_bytes = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (!slots[i].data)
+        {
+            continue;
+        }
+        if (read_ok && results[i] >= 0 && (uint64_t) results[i] <= slots[i].stx.stx_size)
+        {
+            slots[i].len = results[i];
+            batch_files++;
+            batch_bytes += results[i];
+        }
+        else
+        {
+            // A read that did not complete can still write into its buffer, so the buffer is not reused
+            if (read_ok || results[i] != -ECANCELED)
+            {
+                pool_put(pool, slots[i].data);
+            }
+            release_memory(queue, pool->buffer_size);
+            slots[i].data = NULL;
+        }
+    }
+    mdarc_stats_add(STAT_READ_FILES, start, batch_files, batch_bytes);
+    if (!read_ok)
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (slots[i].fd >= 0)
+            {
+                close(slots[i].fd);
+            }
+        }
+        return 1;
+    }
+
+    // Close the whole batch
+    start = mdarc_stats_clock();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (slots[i].fd >= 0)
+        {
+            struct io_uring_sqe *sqe = io_ring_get_sqe(ring);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = slots[i].fd;
+            sqe->user_data = i;
+        }
+    }
+    for (unsigned int i = 0; i < count; i++)
+    {
+        results[i] = -ECANCELED;
+    }
+    ret = io_ring_run(ring, results);
+    if (ret != 0)
+    {
+        // Files the ring closed already must not be closed again, their descriptors can be in use by now
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (slots[i].fd >= 0 && results[i] == -ECANCELED)
+            {
+                close(slots[i].fd);
+            }
+        }
+    }
+    mdarc_stats_add(STAT_OPEN, start, 0, 0); // Closing counts as open/stat time
+    return ret;
+}
+
+
+// Set up an io_uring instance through the raw system calls. Returns 1 if io_uring is not available
+static int io_ring_init(IoRing *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return 1;
+    }
+
+    // Map the submission queue ring, the submission queue entries and the completion queue ring
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        io_ring_free(ring);
+        return 1;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+
+// Unmap and close the ring. It can be freed again, the second time does nothing
+static void io_ring_free(IoRing *ring)
+{
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    ring->sq_ring = NULL;
+    ring->cq_ring = NULL;
+    ring->sqes = NULL;
+    ring->fd = -1;
+}
+
+
+// Get a cleared submission queue entry, submitted with the next io_ring_run()
+static struct io_uring_sqe *io_ring_get_sqe(IoRing *ring)
+{
+    unsigned int index = (*ring->sq_tail + ring->queued) & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+
+// Store the results of the completions on the completion queue by their user_data. Returns how many there were
+static unsigned int io_ring_collect(IoRing *ring, int *results)
+{
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned int collected = 0;
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        results[cqe->user_data] = cqe->res;
+        head++;
+        collected++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return collected;
+}
+
+
+// Submit all queued entries, wait until every one of them completed and store the results by user_data. Returns 1
+// if io_uring_enter() fails. The completions that arrived until then are stored, the others keep their results
+static int io_ring_run(IoRing *ring, int *results)
+{
+    unsigned int count = ring->queued;
+    if (count == 0)
+    {
+        return 0;
+    }
+    ring->queued = 0;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+
+    unsigned int to_submit = count;
+    unsigned int completed = 0;
+    while (completed < count)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            io_ring_collect(ring, results);
+            return 1;
+        }
+        to_submit -= (unsigned int) ret < to_submit ? (unsigned int) ret : to_submit;
+        completed += io_ring_collect(ring, results);
+    }
+    return 0;
+}
+#endif
+
+
+// Read a file one block at a time and compress every block into node->payload
+static int compress_file(CompressQueue *queue, FileNode *node, z_stream *stream)
+{
+    if (strlen(node->file_name) > MAX_PATH_LEN)
+    {
+        fprintf(stderr, "Error: file path too long, skipping %s\n", node->file_name);
+        return 1;
+    }
+
+    BlockReader reader;
+    if (block_reader_open(&reader, node) != 0)
+    {
+        return 1;
+    }
+    // Large files are not compressed into memory, the archive writer streams them block by block
+    if (reader.file && reader.size >= queue->stream_min_size)
+    {
+        block_reader_close(&reader);
+        node->stream = true;
+        return 0;
+    }
+
+    // Take a buffer for one block of file data from the pool
+    unsigned char *block = NULL;
+    if (reader.file)
+    {
+        reserve_memory(queue, node, stream, queue->block_pool.buffer_size);
+        block = pool_get(&queue->block_pool);
+        if (!block)
+        {
+            perror("Error allocating memory for file data");
+            release_memory(queue, queue->block_pool.buffer_size);
+            block_reader_close(&reader);
+            return 1;
+        }
+    }
+
+    size_t bound = compressBound(DATA_BLOCK_SIZE);
+    node->payload = NULL;
+    node->payload_capacity = 0;
+    node->payload_pooled = false;
+    node->payload_size = 0;
+    node->original_size = 0;
+    node->compressed_size = 0;
+    node->checksum = 0;
+    node->sparse = false;
+
+    int ret = 0;
+    int status = 0;
+    const unsigned char *data;
+    size_t len;
+    uint64_t hole_len;
+    while (ret == 0 && (status = read_next_block(&reader, block, &data, &len, &hole_len)) > 0)
+    {
+        if (status == 2)
+        {
+            ret = append_hole(queue, node, stream, hole_len);
+            continue;
+        }
+        // Checksum the block while it is still in the cache
+        uint64_t start = mdarc_stats_clock();
+        node->checksum = crc32c(node->checksum, data, len);
+        mdarc_stats_add(STAT_CHECKSUM, start, 1, len);
+
+        // Compress straight into the payload, keeping the block uncompressed if that does not make it smaller
+        ret = reserve_payload(queue, node, stream, BLOCK_HEADER_SIZE + bound);
+        if (ret != 0)
+        {
+            break;
+        }
+        unsigned char *block_header = node->payload + node->payload_size;
+        uint32_t stored_len = compress_block(stream, data, len, block_header + BLOCK_HEADER_SIZE);
+        if (stored_len == len)
+        {
+            memcpy(block_header + BLOCK_HEADER_SIZE, data, len);
+        }
+        put_u32(block_header, len);
+        put_u32(block_header + 4, stored_len);
+        node->payload_size += BLOCK_HEADER_SIZE + stored_len;
+        node->original_size += len;
+        node->compressed_size += stored_len;
+    }
+    if (status < 0)
+    {
+        ret = 1;
+    }
+    block_reader_close(&reader);
+    if (block)
+    {
+        pool_put(&queue->block_pool, block);
+        release_memory(queue, queue->block_pool.buffer_size);
+    }
+    // Read-ahead buffers go back to their pool, contents added from memory were malloc'ed and counted when they
+    // were copied
+#if HAVE_IO_URING
+    if (node->read_data && node->read_pooled)
+    {
+        pool_put(&queue->read_pool, node->read_data);
+        release_memory(queue, queue->read_pool.buffer_size);
+        node->read_data = NULL;
+    }
+#endif
+    if (node->read_data)
+    {
+        free(node->read_data);
+        release_memory(queue, node->read_len);
+        node->read_data = NULL;
+    }
+
+    // Terminate the block list with an empty block
+    if (ret == 0)
+    {
+        ret = append_block(queue, node, stream, NULL, 0, 0);
+    }
+    if (ret != 0)
+    {
+        free_payload(queue, node);
+    }
+    return ret;
+}
+
+
+// Compress one data block into compressed_block, a buffer of compressBound(DATA_BLOCK_SIZE) bytes. Returns the
+// compressed length, or len if the block is stored uncompressed because compressing does not make it smaller.
+// The deflate state of the calling thread is reset instead of set up again for every block, without one
+// compress() is used
+static uint32_t compress_block(z_stream *stream, const unsigned char *data, uint32_t len,
+                               unsigned char *compressed_block)
+{
+    uint64_t start = mdarc_stats_clock();
+    uLongf compressed_len = compressBound(DATA_BLOCK_SIZE);
+    int ret;
+    if (!stream)
+    {
+        ret = compress(compressed_block, &compressed_len, data, len) == Z_OK ? Z_STREAM_END : Z_DATA_ERROR;
+    }
+    else
+    {
+        deflateReset(stream);
+        stream->next_in = (Bytef *) data;
+        stream->avail_in = len;
+        stream->next_out = compressed_block;
+        stream->avail_out = compressed_len;
+        ret = deflate(stream, Z_FINISH);
+        compressed_len = stream->total_out;
+    }
+    mdarc_stats_add(STAT_COMPRESS, start, 1, len);
+    return ret != Z_STREAM_END || compressed_len >= len ? len : compressed_len;
+}
+
+
+// Decompress one block of original_len bytes with the inflate state of the calling thread, or uncompress()
+// without one. Returns 1 if the block is corrupt
+static int decompress_block(z_stream *stream, const unsigned char *compressed_block, uint32_t len, unsigned char *block,
+                            uint32_t original_len)
+{
+    uint64_t start = mdarc_stats_clock();
+    int corrupt;
+    if (!stream)
+    {
+        uLongf block_len = original_len;
+        corrupt = uncompress(block, &block_len, compressed_block, len) != Z_OK || block_len != original_len;
+    }
+    else
+    {
+        inflateReset(stream);
+        stream->next_in = (Bytef *) compressed_block;
+        stream->avail_in = len;
+        stream->next_out = block;
+        stream->avail_out = original_len;
+        corrupt = inflate(stream, Z_FINISH) != Z_STREAM_END || stream->total_out != original_len;
+    }
+    mdarc_stats_add(STAT_INFLATE, start, 1, original_len);
+    return corrupt;
+}
+
+
+// Set up the deflate state a thread reuses for all its blocks, with the same settings as compress(). Returns NULL
+// if zlib can not allocate it, the blocks are then compressed with compress()
+static z_stream *deflate_stream_init(z_stream *stream)
+{
+    memset(stream, 0, sizeof(z_stream));
+    return deflateInit(stream, Z_DEFAULT_COMPRESSION) == Z_OK ? stream : NULL;
+}
+
+
+// Set up the inflate state a thread reuses for all its blocks. Returns NULL if zlib can not allocate it, the blocks
+// are then decompressed with uncompress()
+static z_stream *inflate_stream_init(z_stream *stream)
+{
+    memset(stream, 0, sizeof(z_stream));
+    return inflateInit(stream) == Z_OK ? stream : NULL;
+}
+
+
+static void pool_init(BufferPool *pool, size_t buffer_size)
+{
+    memset(pool, 0, sizeof(BufferPool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->buffer_size = buffer_size;
+}
+
+
+// Take a buffer from the pool, allocating a new one only if none is free. Returns NULL if out of memory
+static void *pool_get(BufferPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    void *buffer = pool->free_count > 0 ? pool->free_buffers[--pool->free_count] : NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!buffer && posix_memalign(&buffer, DIRECT_IO_ALIGN, pool->buffer_size) != 0)
+    {
+        return NULL;
+    }
+    return buffer;
+}
+
+
+// Hand a buffer back to the pool for the next file
+static void pool_put(BufferPool *pool, void *buffer)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count == pool->free_capacity)
+    {
+        size_t capacity = pool->free_capacity ? pool->free_capacity * 2 : 16;
+        void **free_buffers = realloc(pool->free_buffers, capacity * sizeof(void *));
+        if (!free_buffers)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            free(buffer);
+            return;
+        }
+        pool->free_buffers = free_buffers;
+        pool->free_capacity = capacity;
+    }
+    pool->free_buffers[pool->free_count++] = buffer;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+// Free all buffers in the pool. Buffers still handed out are plain heap memory and can be freed with free()
+static void pool_free(BufferPool *pool)
+{
+    for (size_t i = 0; i < pool->free_count; i++)
+    {
+        free(pool->free_buffers[i]);
+    }
+    free(pool->free_buffers);
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, 0, sizeof(BufferPool));
+}
+
+
+// Give the payload of a node back, to the payload pool if it came from there
+static void free_payload(CompressQueue *queue, FileNode *node)
+{
+    if (node->payload_pooled)
+    {
+        pool_put(&queue->payload_pool, node->payload);
+    }
+    else
+    {
+        free(node->payload);
+    }
+    release_memory(queue, node->payload_capacity);
+    node->payload = NULL;
+    node->payload_capacity = 0;
+    node->payload_pooled = false;
+}
+
+
+// Count bytes about to be held in a data buffer. With --max-memory the worker of node waits until the entries
+// behind the next one to be written are within worker_memory, compressing blocks of a streamed file in the
+// meantime. The entry the writer needs next never waits, everything else is released as the entries before it get
+// written. A NULL node (the writer) never waits either
+static void reserve_memory(CompressQueue *queue, FileNode *node, z_stream *stream, uint64_t bytes)
+{
+    Options *opts = queue->opts;
+    pthread_mutex_lock(&opts->list_lock);
+    while (opts->max_memory > 0 && node != NULL && queue->memory_used + bytes > queue->worker_memory &&
+           node != (queue->last_written ? queue->last_written->next : opts->file_list))
+    {
+        if (queue->stream_taken < queue->stream_read)
+        {
+            uint64_t seq = queue->stream_taken++;
+            pthread_mutex_unlock(&opts->list_lock);
+            compress_stream_slot(queue, seq, stream);
+            pthread_mutex_lock(&opts->list_lock);
+        }
+        else
+        {
+            pthread_cond_wait(&opts->list_changed, &opts->list_lock);
+        }
+    }
+    queue->memory_used += bytes;
+    if (queue->memory_used > queue->memory_peak)
+    {
+        queue->memory_peak = queue->memory_used;
+    }
+    pthread_mutex_unlock(&opts->list_lock);
+}
+
+
+// Count bytes for an optional buffer, such as read-ahead data. Returns false without waiting if there is no room
+// for it within worker_memory
+static bool try_reserve_memory(CompressQueue *queue, uint64_t bytes)
+{
+    Options *opts = queue->opts;
+    pthread_mutex_lock(&opts->list_lock);
+    bool reserved = opts->max_memory == 0 || queue->memory_used + bytes <= queue->worker_memory;
+    if (reserved)
+    {
+        queue->memory_used += bytes;
+        if (queue->memory_used > queue->memory_peak)
+        {
+            queue->memory_peak = queue->memory_used;
+        }
+    }
+    pthread_mutex_unlock(&opts->list_lock);
+    return reserved;
+}
+
+
+// Count the contents of an entry added from memory before it is listed. Waits like a worker while the entries
+// already listed hold the memory, so a library caller adding entries faster than they are compressed is held back.
+// Never waits once every listed entry is written, or if the writer is done
+static void reserve_added_memory(CompressQueue *queue, uint64_t bytes)
+{
+    Options *opts = queue->opts;
+    pthread_mutex_lock(&opts->list_lock);
+    while (opts->max_memory > 0 && queue->memory_used + bytes > queue->worker_memory && !queue->writer_done &&
+           (queue->last_written ? queue->last_written->next : opts->file_list) != NULL)
+    {
+        pthread_cond_wait(&opts->list_changed, &opts->list_lock);
+    }
+    queue->memory_used += bytes;
+    if (queue->memory_used > queue->memory_peak)
+    {
+        queue->memory_peak = queue->memory_used;
+    }
+    pthread_mutex_unlock(&opts->list_lock);
+}
+
+
+static void release_memory(CompressQueue *queue, uint64_t bytes)
+{
+    if (bytes == 0)
+    {
+        return;
+    }
+    Options *opts = queue->opts;
+    pthread_mutex_lock(&opts->list_lock);
+    queue->memory_used -= bytes;
+    if (opts->max_memory > 0)
+    {
+        pthread_cond_broadcast(&opts->list_changed); // Room for waiting workers
+    }
+    pthread_mutex_unlock(&opts->list_lock);
+}
+
+
+// Sizes are in MiB, the unit of the M suffix of --max-memory
+static void print_memory_peak(uint64_t peak, uint64_t limit)
+{
+    fprintf(stderr, "Peak buffered memory: %.1f MiB of %.1f MiB allowed\n", peak / (double) (1 << 20),
+            limit / (double) (1 << 20));
+}
+
+
+// Open the data of a file being archived. Files with fewer allocated blocks than their size have holes, their data
+// regions are found with SEEK_DATA/SEEK_HOLE and the holes in between are never read
+static int block_reader_open(BlockReader *reader, FileNode *node)
+{
+    memset(reader, 0, sizeof(BlockReader));
+
+    // Files already read by the io_uring reader are compressed straight from memory
+    if (node->read_ahead == READ_AHEAD_DATA)
+    {
+        reader->data = node->read_data;
+        reader->size = node->read_len;
+        return 0;
+    }
+    uint64_t start = mdarc_stats_clock();
+    reader->file = fopen(node->file_name, "rb");
+    if (!reader->file)
+    {
+        perror("Error opening file");
+        return 1;
+    }
+
+    struct stat file_stat;
+    if (fstat(fileno(reader->file), &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+    {
+        reader->size = file_stat.st_size;
+#ifdef SEEK_HOLE
+        reader->sparse = (uint64_t) file_stat.st_blocks * 512 < reader->size;
+#endif
+    }
+    mdarc_stats_add(STAT_OPEN, start, 1, 0);
+    return 0;
+}
+
+
+// Read the next block of a file. Returns 1 with the data of the block, read into block unless it comes from the
+// read-ahead data, 2 with the length of a hole, 0 at the end of the file and -1 on read errors
+static int read_next_block(BlockReader *reader, unsigned char *block, const unsigned char **data, size_t *len,
+                           uint64_t *hole_len)
+{
+    if (!reader->file)
+    {
+        *data = reader->data + reader->pos;
+        *len = reader->size - reader->pos < DATA_BLOCK_SIZE ? reader->size - reader->pos : DATA_BLOCK_SIZE;
+        reader->pos += *len;
+        progress_add(0, *len);
+        return *len > 0;
+    }
+
+    size_t want = DATA_BLOCK_SIZE;
+    uint64_t start = mdarc_stats_clock();
+#ifdef SEEK_HOLE
+    if (reader->sparse)
+    {
+        if (reader->pos == reader->region_end)
+        {
+            // Find the next data region, everything before it is a hole
+            int fd = fileno(reader->file);
+            off_t data_start = lseek(fd, reader->pos, SEEK_DATA);
+            if (data_start < 0 || (uint64_t) data_start > reader->size)
+            {
+                data_start = reader->size; // ENXIO: only a hole left up to the end of the file
+            }
+            if ((uint64_t) data_start > reader->pos)
+            {
+                *hole_len = data_start - reader->pos;
+                reader->pos = data_start;
+                reader->region_end = data_start;
+                mdarc_stats_add(STAT_READ_FILES, start, 0, 0);
+                progress_add(0, *hole_len);
+                return 2;
+            }
+            if (reader->pos >= reader->size)
+            {
+                return 0;
+            }
+            off_t hole_start = lseek(fd, reader->pos, SEEK_HOLE);
+            reader->region_end = hole_start > (off_t) reader->pos ? (uint64_t) hole_start : reader->size;
+            if (fseeko(reader->file, reader->pos, SEEK_SET) != 0)
+            {
+                perror("Error reading file");
+                return -1;
+            }
+        }
+        if (reader->region_end - reader->pos < want)
+        {
+            want = reader->region_end - reader->pos;
+        }
+    }
+#endif
+
+    *data = block;
+    *len = fread(block, 1, want, reader->file);
+    reader->pos += *len;
+    mdarc_stats_add(STAT_READ_FILES, start, *len > 0, *len);
+    progress_add(0, *len);
+    if (*len == 0)
+    {
+        if (ferror(reader->file))
+        {
+            perror("Error reading file");
+            return -1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+
+static void block_reader_close(BlockReader *reader)
+{
+    if (reader->file)
+    {
+        uint64_t start = mdarc_stats_clock();
+        fclose(reader->file);
+        reader->file = NULL;
+        mdarc_stats_add(STAT_OPEN, start, 0, 0);
+    }
+}
+
+
+// Append hole blocks for len zero bytes of a sparse file, and add the zeros to the checksum
+static int append_hole(CompressQueue *queue, FileNode *node, z_stream *stream, uint64_t len)
+{
+    node->checksum = crc32c_append_zeros(node->checksum, len);
+    node->sparse = true;
+    while (len > 0)
+    {
+        uint32_t hole_len = len < HOLE_BLOCK_MAX ? len : HOLE_BLOCK_MAX;
+        if (append_block(queue, node, stream, NULL, 0, hole_len) != 0)
+        {
+            return 1;
+        }
+        len -= hole_len;
+    }
+    return 0;
+}
+
+
+// Make room for len more bytes in node->payload. The payload starts in a buffer of the payload pool, which holds
+// any file of one block. Larger payloads move to a malloc'ed buffer that doubles as it grows
+static int reserve_payload(CompressQueue *queue, FileNode *node, z_stream *stream, size_t len)
+{
+    size_t needed = node->payload_size + len;
+    if (!node->payload && needed <= queue->payload_pool.buffer_size)
+    {
+        reserve_memory(queue, node, stream, queue->payload_pool.buffer_size);
+        node->payload = pool_get(&queue->payload_pool);
+        if (!node->payload)
+        {
+            perror("Error allocating memory for compressed data");
+            release_memory(queue, queue->payload_pool.buffer_size);
+            return 1;
+        }
+        node->payload_pooled = true;
+        node->payload_capacity = queue->payload_pool.buffer_size;
+    }
+    if (needed <= node->payload_capacity)
+    {
+        return 0;
+    }
+
+    size_t new_capacity = node->payload_capacity ? node->payload_capacity * 2 : needed;
+    while (new_capacity < needed)
+    {
+        new_capacity *= 2;
+    }
+    // Both buffers exist while the data is copied
+    reserve_memory(queue, node, stream, new_capacity);
+    unsigned char *payload;
+    if (node->payload_pooled)
+    {
+        payload = malloc(new_capacity);
+        if (payload)
+        {
+            memcpy(payload, node->payload, node->payload_size);
+            pool_put(&queue->payload_pool, node->payload);
+            node->payload_pooled = false;
+        }
+    }
+    else
+    {
+        payload = realloc(node->payload, new_capacity);
+    }
+    if (!payload)
+    {
+        perror("Error allocating memory for compressed data");
+        release_memory(queue, new_capacity);
+        return 1;
+    }
+    release_memory(queue, node->payload_capacity);
+    node->payload = payload;
+    node->payload_capacity = new_capacity;
+    return 0;
+}
+
+
+// Append a block header and the block data to node->payload
+static int append_block(CompressQueue *queue, FileNode *node, z_stream *stream, const unsigned char *data, uint32_t len,
+                        uint32_t original_len)
+{
+    if (reserve_payload(queue, node, stream, BLOCK_HEADER_SIZE + len) != 0)
+    {
+        return 1;
+    }
+
+    unsigned char *block_header = node->payload + node->payload_size;
+    put_u32(block_header, original_len);
+    put_u32(block_header + 4, len);
+    if (len > 0)
+    {
+        memcpy(block_header + BLOCK_HEADER_SIZE, data, len);
+    }
+    node->payload_size += BLOCK_HEADER_SIZE + len;
+    node->original_size += original_len;
+    node->compressed_size += len;
+    return 0;
+}
+
+
+// Write one compressed entry: entry header, file path, data blocks and the data descriptor
+static int add_file_to_archive(ArchiveStream *out, FileNode *node)
+{
+    size_t path_len = strlen(node->archive_path);
+    unsigned char header[ENTRY_HEADER_SIZE];
+    put_u32(header, ENTRY_SIGNATURE);
+    put_u16(header + 4, path_len);
+    put_u16(header + 6, node->sparse ? ENTRY_FLAG_SPARSE : 0);
+    put_u64(header + 8, node->original_size);
+
+    unsigned char descriptor[DESCRIPTOR_SIZE];
+    put_u32(descriptor, DESCRIPTOR_SIGNATURE);
+    put_u64(descriptor + 4, node->original_size);
+    put_u64(descriptor + 12, node->compressed_size);
+    put_u32(descriptor + 20, node->checksum);
+
+    node->header_offset = out->offset;
+    if (write_bytes(out, header, ENTRY_HEADER_SIZE) != 0 ||
+        write_bytes(out, node->archive_path, path_len) != 0 ||
+        write_bytes(out, node->payload, node->payload_size) != 0 ||
+        write_bytes(out, descriptor, DESCRIPTOR_SIZE) != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+
+// Write a large file block by block, without holding its compressed data in memory. The writer reads ahead into
+// the stream slots, the workers compress them and the writer writes them in order. Returns 0 when the entry was
+// written, 1 on archive write errors and 2 if the file could not be opened. A file that can not be read to the
+// end is written up to there, its data descriptor has the size actually read and incomplete is set
+static int stream_file_to_archive(ArchiveStream *out, CompressQueue *queue, FileNode *node, z_stream *stream,
+                                  bool *incomplete)
+{
+    Options *opts = queue->opts;
+    BlockReader reader;
+    if (block_reader_open(&reader, node) != 0)
+    {
+        return 2;
+    }
+    if (alloc_stream_slots(queue) != 0)
+    {
+        block_reader_close(&reader);
+        return 2;
+    }
+
+    // The entry header has the size from fstat(), the data descriptor the size actually read
+    size_t path_len = strlen(node->archive_path);
+    unsigned char header[ENTRY_HEADER_SIZE];
+    put_u32(header, ENTRY_SIGNATURE);
+    put_u16(header + 4, path_len);
+    put_u16(header + 6, reader.sparse ? ENTRY_FLAG_SPARSE : 0);
+    put_u64(header + 8, reader.size);
+    node->header_offset = out->offset;
+    node->original_size = 0;
+    node->compressed_size = 0;
+    node->checksum = 0;
+    node->sparse = reader.sparse;
+    if (write_bytes(out, header, ENTRY_HEADER_SIZE) != 0 || write_bytes(out, node->archive_path, path_len) != 0)
+    {
+        block_reader_close(&reader);
+        free_stream_slots(queue);
+        return 1;
+    }
+
+    bool end = false;
+    bool read_failed = false;
+    bool write_failed = false;
+    while (true)
+    {
+        // Read ahead into all free slots, the workers compress them in the meantime
+        while (!end && queue->stream_read - queue->stream_written < queue->stream_capacity)
+        {
+            StreamSlot *slot = &queue->stream_slots[queue->stream_read % queue->stream_capacity];
+            const unsigned char *data;
+            size_t len;
+            uint64_t hole_len;
+            int status = read_next_block(&reader, slot->data, &data, &len, &hole_len);
+            if (status <= 0)
+            {
+                end = true;
+                read_failed = status < 0;
+                break;
+            }
+            slot->done = false;
+            slot->len = status == 1 ? len : 0;
+            slot->hole_len = status == 2 ? hole_len : 0;
+            uint64_t start = mdarc_stats_clock();
+            node->checksum = status == 2 ? crc32c_append_zeros(node->checksum, hole_len)
+                                         : crc32c(node->checksum, slot->data, len);
+            mdarc_stats_add(STAT_CHECKSUM, start, 1, slot->len);
+
+            pthread_mutex_lock(&opts->list_lock);
+            queue->stream_read++;
+            pthread_cond_broadcast(&opts->list_changed);
+            pthread_mutex_unlock(&opts->list_lock);
+        }
+        if (queue->stream_written == queue->stream_read)
+        {
+            break;
+        }
+
+        // Write the oldest block once it is compressed, compressing blocks here as well while waiting. After a
+        // write error the blocks are only drained
+        StreamSlot *slot = &queue->stream_slots[queue->stream_written % queue->stream_capacity];
+        pthread_mutex_lock(&opts->list_lock);
+        while (!slot->done)
+        {
+            if (queue->stream_taken < queue->stream_read)
+            {
+                uint64_t seq = queue->stream_taken++;
+                pthread_mutex_unlock(&opts->list_lock);
+                compress_stream_slot(queue, seq, stream);
+                pthread_mutex_lock(&opts->list_lock);
+            }
+            else
+            {
+                pthread_cond_wait(&opts->list_changed, &opts->list_lock);
+            }
+        }
+        pthread_mutex_unlock(&opts->list_lock);
+        if (!write_failed)
+        {
+            write_failed = write_stream_slot(out, node, slot) != 0;
+        }
+        queue->stream_written++;
+    }
+    block_reader_close(&reader);
+    free_stream_slots(queue);
+    if (write_failed)
+    {
+        return 1;
+    }
+
+    // End of data marker and data descriptor
+    unsigned char block_header[BLOCK_HEADER_SIZE] = {0};
+    unsigned char descriptor[DESCRIPTOR_SIZE];
+    put_u32(descriptor, DESCRIPTOR_SIGNATURE);
+    put_u64(descriptor + 4, node->original_size);
+    put_u64(descriptor + 12, node->compressed_size);
+    put_u32(descriptor + 20, node->checksum);
+    if (write_bytes(out, block_header, BLOCK_HEADER_SIZE) != 0 || write_bytes(out, descriptor, DESCRIPTOR_SIZE) != 0)
+    {
+        return 1;
+    }
+    if (read_failed)
+    {
+        fprintf(stderr, "Error reading %s, archived data is incomplete\n", node->file_name);
+        *incomplete = true;
+    }
+    return 0;
+}
+
+
+// Take the stream slots for one file from the pools, two per worker so the writer can read ahead while all workers
+// compress, fewer with --max-memory
+static int alloc_stream_slots(CompressQueue *queue)
+{
+    uint64_t slot_size = queue->block_pool.buffer_size + queue->payload_pool.buffer_size;
+    unsigned int capacity = queue->stream_slot_count;
+    queue->stream_slots = calloc(capacity, sizeof(StreamSlot));
+    if (!queue->stream_slots)
+    {
+        perror("Error allocating memory for file data");
+        return 1;
+    }
+    queue->stream_capacity = capacity;
+    reserve_memory(queue, NULL, NULL, capacity * slot_size); // Room kept free for it, the writer does not wait
+    for (unsigned int i = 0; i < capacity; i++)
+    {
+        StreamSlot *slot = &queue->stream_slots[i];
+        slot->data = pool_get(&queue->block_pool);
+        slot->compressed = pool_get(&queue->payload_pool);
+        if (!slot->data || !slot->compressed)
+        {
+            perror("Error allocating memory for file data");
+            free_stream_slots(queue);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void free_stream_slots(CompressQueue *queue)
+{
+    for (unsigned int i = 0; queue->stream_slots && i < queue->stream_capacity; i++)
+    {
+        if (queue->stream_slots[i].data)
+        {
+            pool_put(&queue->block_pool, queue->stream_slots[i].data);
+        }
+        if (queue->stream_slots[i].compressed)
+        {
+            pool_put(&queue->payload_pool, queue->stream_slots[i].compressed);
+        }
+    }
+    uint64_t slot_size = queue->block_pool.buffer_size + queue->payload_pool.buffer_size;
+    release_memory(queue, queue->stream_capacity * slot_size);
+    free(queue->stream_slots);
+    queue->stream_slots = NULL;
+    queue->stream_capacity = 0;
+}
+
+
+// Compress the stream slot of block number seq, called by the workers and the writer with their deflate state
+static void compress_stream_slot(CompressQueue *queue, uint64_t seq, z_stream *stream)
+{
+    StreamSlot *slot = &queue->stream_slots[seq % queue->stream_capacity];
+    if (slot->hole_len == 0)
+    {
+        slot->stored_len = compress_block(stream, slot->data, slot->len, slot->compressed);
+    }
+
+    pthread_mutex_lock(&queue->opts->list_lock);
+    slot->done = true;
+    pthread_cond_broadcast(&queue->opts->list_changed);
+    pthread_mutex_unlock(&queue->opts->list_lock);
+}
+
+
+// Write the block (or hole blocks) of a stream slot
+static int write_stream_slot(ArchiveStream *out, FileNode *node, StreamSlot *slot)
+{
+    unsigned char block_header[BLOCK_HEADER_SIZE];
+    for (uint64_t left = slot->hole_len; left > 0;)
+    {
+        uint32_t hole_len = left < HOLE_BLOCK_MAX ? left : HOLE_BLOCK_MAX;
+        put_u32(block_header, hole_len);
+        put_u32(block_header + 4, 0);
+        if (write_bytes(out, block_header, BLOCK_HEADER_SIZE) != 0)
+        {
+            return 1;
+        }
+        node->original_size += hole_len;
+        left -= hole_len;
+    }
+    if (slot->hole_len > 0)
+    {
+        return 0;
+    }
+
+    put_u32(block_header, slot->len);
+    put_u32(block_header + 4, slot->stored_len);
+    if (write_bytes(out, block_header, BLOCK_HEADER_SIZE) != 0 ||
+        write_bytes(out, slot->stored_len < slot->len ? slot->compressed : slot->data, slot->stored_len) != 0)
+    {
+        return 1;
+    }
+    node->original_size += slot->len;
+    node->compressed_size += slot->stored_len;
+    return 0;
+}
+
+
+int mdarc_unarchive_files(Options *opts)
+{
+    ArchiveStream in = {0};
+    if (open_archive(opts->archive_name, &in) != 0)
+    {
+        return 1;
+    }
+
+    int ret = 0;
+    if (opts->l) // List contents of archive without extracting
+    {
+        printf("\nArchive contents:\n\n");
+        // Seekable archives are listed from the index at the end, otherwise read through all entries
+        const char *prefix = opts->prefix ? opts->prefix : "";
+        int listed = in.seekable ? list_archive_index(&in, prefix) : 1;
+        if (listed < 0)
+        {
+            ret = -1;
+        }
+        else if (listed > 0)
+        {
+            char file_path[MAX_PATH_LEN + 1];
+            uint64_t original_size;
+            while ((ret = read_entry_header(&in, file_path, &original_size, NULL)) == 1)
+            {
+                if (strncmp(file_path, prefix, strlen(prefix)) == 0)
+                {
+                    printf("%s\n", file_path);
+                }
+                if (skip_entry_data(&in) != 0)
+                {
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+        printf("\n");
+    }
+    else // Extract archive contents
+    {
+        DecodeTotals totals;
+        ret = decode_archive(&in, opts, DECODE_EXTRACT, &totals);
+    }
+    close_archive(in.file);
+    return ret != 0;
+}
+
+
+// Decode every entry of an archive without writing anything, to check that it can be extracted intact
+int mdarc_test_archive(Options *opts)
+{
+    ArchiveStream in = {0};
+    if (open_archive(opts->archive_name, &in) != 0)
+    {
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    DecodeTotals totals;
+    int ret = decode_archive(&in, opts, DECODE_TEST, &totals);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close_archive(in.file);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double megabytes = totals.bytes / (1024.0 * 1024.0);
+    printf("Tested %" PRIu64 " files, %.1f MB in %.2f s (%.1f MB/s)\n", totals.files, megabytes, seconds,
+           seconds > 0 ? megabytes / seconds : 0.0);
+    if (totals.errors > 0)
+    {
+        printf("%" PRIu64 " files with errors\n", totals.errors);
+    }
+    else if (ret == 0)
+    {
+        printf("No errors found\n");
+    }
+    return ret;
+}
+
+
+// Write files stored in an archive to stdout, decompressing one block at a time. Seekable archives are searched
+// through the index, otherwise the archive is read through until all files are found
+int mdarc_cat_archive(Options *opts)
+{
+    ArchiveStream in = {0};
+    if (open_archive(opts->archive_name, &in) != 0)
+    {
+        return 1;
+    }
+
+    unsigned char *block = malloc(DATA_BLOCK_SIZE);
+    unsigned char *compressed_block = malloc(compressBound(DATA_BLOCK_SIZE));
+    bool *found = calloc(opts->member_count, sizeof(bool));
+    if (!block || !compressed_block || !found)
+    {
+        perror("Error allocating memory for file data");
+        free(block);
+        free(compressed_block);
+        free(found);
+        close_archive(in.file);
+        return 1;
+    }
+    z_stream inflate_state;
+    z_stream *stream = inflate_stream_init(&inflate_state);
+
+    int ret = 0;
+    char file_path[MAX_PATH_LEN + 1];
+    uint64_t original_size;
+    ArchiveIndex index = {0};
+    int index_status = in.seekable ? open_archive_index(&in, &index) : 1;
+    if (index_status == 0)
+    {
+        // Files are written in command line order, jumping straight to their entries
+        for (int i = 0; i < opts->member_count && ret == 0; i++)
+        {
+            IndexEntry *entry;
+            int status = find_index_entry(&index, opts->members[i], &entry);
+            if (status < 0)
+            {
+                ret = 1;
+            }
+            else if (status == 1)
+            {
+                found[i] = true;
+                uint64_t header_offset = entry->header_offset;
+                if (fseeko(in.file, header_offset, SEEK_SET) != 0)
+                {
+                    perror("Error reading archive");
+                    ret = 1;
+                    break;
+                }
+                in.offset = header_offset;
+                if (read_entry_header(&in, file_path, &original_size, NULL) != 1 ||
+                    strcmp(file_path, opts->members[i]) != 0)
+                {
+                    fprintf(stderr, "Error: corrupt archive (index does not match entry)\n");
+                    ret = 1;
+                    break;
+                }
+                ret = write_entry_data(&in, stdout, block, compressed_block, stream);
+            }
+        }
+    }
+    else if (index_status > 0)
+    {
+        // Without an index files are written in archive order
+        int found_count = 0;
+        int status = 0;
+        while (ret == 0 && found_count < opts->member_count &&
+               (status = read_entry_header(&in, file_path, &original_size, NULL)) == 1)
+        {
+            int member = -1;
+            for (int i = 0; i < opts->member_count && member == -1; i++)
+            {
+                if (!found[i] && strcmp(opts->members[i], file_path) == 0)
+                {
+                    member = i;
+                }
+            }
+            if (member == -1)
+            {
+                ret = skip_entry_data(&in);
+                continue;
+            }
+            found[member] = true;
+            found_count++;
+            ret = write_entry_data(&in, stdout, block, compressed_block, stream);
+        }
+        if (ret == 0 && found_count < opts->member_count && status < 0)
+        {
+            ret = 1;
+        }
+    }
+    else
+    {
+        ret = 1;
+    }
+
+    if (fflush(stdout) != 0)
+    {
+        perror("Error writing output");
+        ret = 1;
+    }
+    for (int i = 0; i < opts->member_count && ret == 0; i++)
+    {
+        if (!found[i])
+        {
+            fprintf(stderr, "Error: %s not found in archive\n", opts->members[i]);
+        }
+    }
+    for (int i = 0; i < opts->member_count; i++)
+    {
+        ret |= !found[i];
+    }
+
+    if (stream)
+    {
+        inflateEnd(stream);
+    }
+    close_archive_index(&index);
+    free(block);
+    free(compressed_block);
+    free(found);
+    close_archive(in.file);
+    return ret;
+}
+
+
+// Search the contents of archive members for a fixed string (or a regular expression with -E) and print the
+// matching lines as "member:line". Seekable archives are searched by several workers, one member each, and the
+// results are printed in archive order. Returns 0 if a line matched, 1 if none did and 2 on errors, like grep
+int mdarc_grep_archive(Options *opts)
+{
+    ArchiveStream in = {0};
+    if (open_archive(opts->archive_name, &in) != 0)
+    {
+        return 2;
+    }
+
+    int ret = 0;
+    bool matched = false;
+    // Every worker opens the archive itself, which is not possible for stdin
+    ArchiveIndex index = {0};
+    int index_status = in.seekable && strcmp(opts->archive_name, "-") != 0 ? open_archive_index(&in, &index) : 1;
+    if (index_status == 0)
+    {
+        // Collect the selected members from the index, the workers then jump straight to their entries
+        GrepQueue queue = { .opts = opts, .max_ahead = opts->threads * QUEUE_DEPTH_PER_THREAD };
+        size_t capacity = 0;
+        for (uint32_t block = 0; block < index.block_count && ret == 0; block++)
+        {
+            if (load_index_block(&index, block) != 0)
+            {
+                ret = 1;
+                break;
+            }
+            for (uint32_t i = 0; i < index.blocks[block].entry_count && ret == 0; i++)
+            {
+                IndexEntry *index_entry = &index.entries[i];
+                if (!is_member_selected(opts, index_entry->path))
+                {
+                    continue;
+                }
+                if (queue.entry_count == capacity)
+                {
+                    capacity = capacity ? 2 * capacity : 64;
+                    GrepEntry *entries = realloc(queue.entries, capacity * sizeof(GrepEntry));
+                    if (!entries)
+                    {
+                        perror("Error allocating memory for archive index");
+                        ret = 1;
+                        break;
+                    }
+                    queue.entries = entries;
+                }
+                GrepEntry *entry = &queue.entries[queue.entry_count];
+                memset(entry, 0, sizeof(GrepEntry));
+                entry->header_offset = index_entry->header_offset;
+                entry->file_path = strdup(index_entry->path);
+                if (!entry->file_path)
+                {
+                    perror("Error allocating memory for archive index");
+                    ret = 1;
+                    break;
+                }
+                queue.entry_count++;
+            }
+        }
+        close_archive_index(&index);
+
+        // The index is in path order, the members are searched and printed in archive order
+        qsort(queue.entries, queue.entry_count, sizeof(GrepEntry), compare_grep_offset);
+        if (ret == 0)
+        {
+            ret = grep_parallel(&queue, &matched);
+        }
+        for (size_t i = 0; i < queue.entry_count; i++)
+        {
+            free(queue.entries[i].file_path);
+            free(queue.entries[i].output);
+        }
+        free(queue.entries);
+    }
+    else if (index_status > 0)
+    {
+        ret = grep_sequential(&in, opts, &matched);
+    }
+    else
+    {
+        ret = 1;
+    }
+
+    if (fflush(stdout) != 0)
+    {
+        perror("Error writing output");
+        ret = 1;
+    }
+    close_archive(in.file);
+    return ret != 0 ? 2 : matched ? 0 : 1;
+}
+
+
+static int compare_grep_offset(const void *a, const void *b)
+{
+    const GrepEntry *ea = a;
+    const GrepEntry *eb = b;
+    if (ea->header_offset != eb->header_offset)
+    {
+        return ea->header_offset < eb->header_offset ? -1 : 1;
+    }
+    return 0;
+}
+
+
+// Search the members listed in the queue with a pool of workers and print their results in queue order
+static int grep_parallel(GrepQueue *queue, bool *matched)
+{
+    Options *opts = queue->opts;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+
+    // Start the search workers, each with its own stream of the archive
+    unsigned int worker_limit = queue->entry_count < opts->threads ? queue->entry_count : opts->threads;
+    GrepWorker *workers = calloc(worker_limit ? worker_limit : 1, sizeof(GrepWorker));
+    unsigned int worker_count = 0;
+    if (!workers)
+    {
+        perror("Error allocating memory for search workers");
+    }
+    while (workers && worker_count < worker_limit)
+    {
+        GrepWorker *worker = &workers[worker_count];
+        FILE *file = fopen(opts->archive_name, "rb");
+        if (!file)
+        {
+            perror("Error opening archive");
+            break;
+        }
+        if (grep_worker_init(worker, opts, file) != 0)
+        {
+            fclose(file);
+            break;
+        }
+        worker->queue = queue;
+        worker->in.seekable = true;
+        if (pthread_create(&worker->thread, NULL, grep_worker, worker) != 0)
+        {
+            perror("Error starting search worker");
+            grep_worker_free(worker);
+            break;
+        }
+        worker_count++;
+    }
+
+    int ret = 0;
+    if (worker_count == 0 && queue->entry_count > 0)
+    {
+        ret = 1;
+    }
+    for (size_t i = 0; i < queue->entry_count && ret == 0; i++)
+    {
+        // Wait for the next member in order and print its matching lines
+        GrepEntry *entry = &queue->entries[i];
+        pthread_mutex_lock(&queue->lock);
+        while (!entry->done)
+        {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        if (entry->output_len > 0 && fwrite(entry->output, 1, entry->output_len, stdout) != entry->output_len)
+        {
+            perror("Error writing output");
+            ret = 1;
+        }
+        *matched |= entry->matched;
+        if (entry->failed)
+        {
+            ret = 1;
+        }
+        free(entry->output);
+        entry->output = NULL;
+
+        // Let the workers claim the next members
+        pthread_mutex_lock(&queue->lock);
+        queue->printed++;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    // After an error the workers only need to be stopped
+    pthread_mutex_lock(&queue->lock);
+    queue->next = queue->entry_count;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    for (unsigned int i = 0; i < worker_count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        grep_worker_free(&workers[i]);
+    }
+    free(workers);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+    return ret;
+}
+
+
+// Search worker thread. Claims the next member of the queue and searches it through the worker's own stream
+static void *grep_worker(void *arg)
+{
+    GrepWorker *worker = arg;
+    GrepQueue *queue = worker->queue;
+    mdarc_trace_thread("grep worker");
+    while (true)
+    {
+        // Stay a limited number of members ahead of the printed output
+        pthread_mutex_lock(&queue->lock);
+        while (queue->next < queue->entry_count && queue->next >= queue->printed + queue->max_ahead)
+        {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        if (queue->next >= queue->entry_count)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        GrepEntry *entry = &queue->entries[queue->next++];
+        pthread_mutex_unlock(&queue->lock);
+
+        char file_path[MAX_PATH_LEN + 1];
+        uint64_t original_size;
+        bool failed = true;
+        trace_label(entry->file_path);
+        if (fseeko(worker->in.file, entry->header_offset, SEEK_SET) != 0)
+        {
+            perror("Error reading archive");
+        }
+        else
+        {
+            worker->in.offset = entry->header_offset;
+            if (read_entry_header(&worker->in, file_path, &original_size, NULL) != 1 ||
+                strcmp(file_path, entry->file_path) != 0)
+            {
+                fprintf(stderr, "Error: corrupt archive (index does not match entry)\n");
+            }
+            else
+            {
+                failed = grep_entry(worker, entry) != 0;
+            }
+        }
+        if (failed)
+        {
+            fprintf(stderr, "Error searching %s\n", entry->file_path);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        entry->failed = failed;
+        entry->done = true;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+
+// Search an archive front to back on the calling thread, for pipes and archives without an index
+static int grep_sequential(ArchiveStream *in, Options *opts, bool *matched)
+{
+    GrepWorker worker;
+    if (grep_worker_init(&worker, opts, in->file) != 0)
+    {
+        return 1;
+    }
+    worker.in = *in;
+
+    int ret = 0;
+    int status;
+    char file_path[MAX_PATH_LEN + 1];
+    uint64_t original_size;
+    while ((status = read_entry_header(&worker.in, file_path, &original_size, NULL)) == 1)
+    {
+        if (!is_member_selected(opts, file_path))
+        {
+            if (skip_entry_data(&worker.in) != 0)
+            {
+                ret = 1;
+                break;
+            }
+            continue;
+        }
+
+        GrepEntry entry = { .file_path = file_path };
+        if (grep_entry(&worker, &entry) != 0)
+        {
+            fprintf(stderr, "Error searching %s\n", file_path);
+            ret = 1;
+        }
+        if (entry.output_len > 0 && fwrite(entry.output, 1, entry.output_len, stdout) != entry.output_len)
+        {
+            perror("Error writing output");
+            ret = 1;
+        }
+        *matched |= entry.matched;
+        free(entry.output);
+        // The position in the stream is unknown after an error
+        if (ret != 0)
+        {
+            break;
+        }
+    }
+    if (status < 0)
+    {
+        ret = 1;
+    }
+
+    worker.in.file = NULL; // Closed by the caller
+    grep_worker_free(&worker);
+    return ret;
+}
+
+
+// Set up the buffers and the compiled pattern of a search worker reading the archive through file
+static int grep_worker_init(GrepWorker *worker, Options *opts, FILE *file)
+{
+    memset(worker, 0, sizeof(GrepWorker));
+    worker->in.file = file;
+    worker->pattern = opts->pattern;
+    worker->pattern_len = strlen(opts->pattern);
+    worker->use_regex = opts->regex;
+    worker->block = malloc(DATA_BLOCK_SIZE);
+    worker->compressed_block = malloc(compressBound(DATA_BLOCK_SIZE));
+    if (!worker->block || !worker->compressed_block)
+    {
+        perror("Error allocating memory for file data");
+        free(worker->block);
+        free(worker->compressed_block);
+        return 1;
+    }
+
+    // Every worker has its own copy of the expression, glibc serializes regexec() calls on the same one
+    if (worker->use_regex)
+    {
+        int err = regcomp(&worker->regex, opts->pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+        if (err != 0)
+        {
+            char message[256];
+            regerror(err, &worker->regex, message, sizeof(message));
+            fprintf(stderr, "Error: invalid regular expression: %s\n", message);
+            free(worker->block);
+            free(worker->compressed_block);
+            return 1;
+        }
+    }
+    worker->stream = inflate_stream_init(&worker->inflate_state);
+    return 0;
+}
+
+
+static void grep_worker_free(GrepWorker *worker)
+{
+    if (worker->in.file)
+    {
+        fclose(worker->in.file);
+    }
+    if (worker->use_regex)
+    {
+        regfree(&worker->regex);
+    }
+    if (worker->stream)
+    {
+        inflateEnd(worker->stream);
+    }
+    free(worker->block);
+    free(worker->compressed_block);
+    free(worker->carry);
+}
+
+
+// Decompress the data of an entry block by block and search it. Lines are split by block boundaries, so the
+// unterminated end of every block is carried over into the next one
+static int grep_entry(GrepWorker *worker, GrepEntry *entry)
+{
+    uint64_t original_size = 0;
+    uint64_t compressed_size = 0;
+    uint32_t checksum = 0;
+    uint32_t original_len, len;
+    int ret;
+    worker->carry_len = 0;
+    while ((ret = read_data_block(&worker->in, worker->block, worker->compressed_block, worker->stream,
+                                  &original_len, &len)) > 0)
+    {
+        // Holes of sparse files are only checksummed and end the current line, so data regions far apart
+        // are not joined into one line
+        if (ret == 2)
+        {
+            checksum = crc32c_append_zeros(checksum, original_len);
+            if (worker->carry_len > 0 && grep_lines(worker, entry, worker->carry, worker->carry_len) != 0)
+            {
+                return 1;
+            }
+            worker->carry_len = 0;
+        }
+        else
+        {
+            checksum = crc32c(checksum, worker->block, original_len);
+            if (grep_block(worker, entry, (const char *) worker->block, original_len) != 0)
+            {
+                return 1;
+            }
+        }
+        original_size += original_len;
+        compressed_size += len;
+    }
+    if (ret < 0)
+    {
+        return 1;
+    }
+    // The last line of a file does not need to end with a newline
+    if (worker->carry_len > 0 && grep_lines(worker, entry, worker->carry, worker->carry_len) != 0)
+    {
+        return 1;
+    }
+    return check_data_descriptor(&worker->in, original_size, compressed_size, checksum);
+}
+
+
+// Search one decompressed block, completing the line carried over from the previous block first
+static int grep_block(GrepWorker *worker, GrepEntry *entry, const char *data, size_t len)
+{
+    size_t start = 0;
+    if (worker->carry_len > 0)
+    {
+        const char *newline = memchr(data, '\n', len);
+        size_t head = newline ? (size_t) (newline - data) + 1 : len;
+        if (append_carry(worker, data, head) != 0)
+        {
+            return 1;
+        }
+        if (!newline)
+        {
+            return 0;
+        }
+        if (grep_lines(worker, entry, worker->carry, worker->carry_len) != 0)
+        {
+            return 1;
+        }
+        worker->carry_len = 0;
+        start = head;
+    }
+
+    // The complete lines are searched in one pass, the unterminated rest waits for the next block
+    const char *last_newline = memrchr(data + start, '\n', len - start);
+    size_t end = last_newline ? (size_t) (last_newline - data) + 1 : start;
+    if (end > start && grep_lines(worker, entry, data + start, end - start) != 0)
+    {
+        return 1;
+    }
+    return append_carry(worker, data + end, len - end);
+}
+
+
+// Search a run of whole lines and add the matching ones to the output of the entry
+static int grep_lines(GrepWorker *worker, GrepEntry *entry, const char *data, size_t len)
+{
+    const char *end = data + len;
+    const char *p = data;
+    while (p < end)
+    {
+        const char *line;
+        const char *line_end;
+        if (!worker->use_regex)
+        {
+            // memmem() skips over data without a match much faster than looking at every line separately,
+            // only the lines around the hits are located
+            const char *hit = memmem(p, end - p, worker->pattern, worker->pattern_len);
+            if (!hit)
+            {
+                break;
+            }
+            line = memrchr(p, '\n', hit - p);
+            line = line ? line + 1 : p;
+            line_end = memchr(hit, '\n', end - hit);
+        }
+        else
+        {
+            line = p;
+            line_end = memchr(p, '\n', end - p);
+        }
+        if (!line_end)
+        {
+            line_end = end;
+        }
+        p = line_end + 1;
+
+        if (worker->use_regex)
+        {
+            regmatch_t match = { .rm_so = 0, .rm_eo = line_end - line };
+            if (regexec(&worker->regex, line, 1, &match, REG_STARTEND) != 0)
+            {
+                continue;
+            }
+        }
+        entry->matched = true;
+        if (append_output(entry, entry->file_path, strlen(entry->file_path)) != 0 ||
+            append_output(entry, ":", 1) != 0 || append_output(entry, line, line_end - line) != 0 ||
+            append_output(entry, "\n", 1) != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static int append_carry(GrepWorker *worker, const char *data, size_t len)
+{
+    if (worker->carry_len + len > worker->carry_capacity)
+    {
+        size_t capacity = worker->carry_capacity ? worker->carry_capacity : 4096;
+        while (capacity < worker->carry_len + len)
+        {
+            capacity *= 2;
+        }
+        char *carry = realloc(worker->carry, capacity);
+        if (!carry)
+        {
+            perror("Error allocating memory for search");
+            return 1;
+        }
+        worker->carry = carry;
+        worker->carry_capacity = capacity;
+    }
+    memcpy(worker->carry + worker->carry_len, data, len);
+    worker->carry_len += len;
+    return 0;
+}
+
+
+static int append_output(GrepEntry *entry, const char *data, size_t len)
+{
+    if (entry->output_len + len > entry->output_capacity)
+    {
+        size_t capacity = entry->output_capacity ? entry->output_capacity : 4096;
+        while (capacity < entry->output_len + len)
+        {
+            capacity *= 2;
+        }
+        char *output = realloc(entry->output, capacity);
+        if (!output)
+        {
+            perror("Error allocating memory for search results");
+            return 1;
+        }
+        entry->output = output;
+        entry->output_capacity = capacity;
+    }
+    memcpy(entry->output + entry->output_len, data, len);
+    entry->output_len += len;
+    return 0;
+}
+
+
+// Check if an archive member was selected on the command line, by exact path or wildcard pattern. Without any
+// member arguments every member is selected
+static bool is_member_selected(const Options *opts, const char *file_path)
+{
+    if (opts->member_count == 0)
+    {
+        return true;
+    }
+    for (int i = 0; i < opts->member_count; i++)
+    {
+        if (fnmatch(opts->members[i], file_path, 0) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Open an archive for reading and check its header, "-" reads the archive from stdin
+static int open_archive(const char *archive_name, ArchiveStream *in)
+{
+    if (strcmp(archive_name, "-") == 0)
+    {
+        if (isatty(STDIN_FILENO))
+        {
+            fprintf(stderr, "Error: refusing to read archive from a terminal\n");
+            return 1;
+        }
+        in->file = stdin;
+    }
+    else
+    {
+        in->file = fopen(archive_name, "rb");
+    }
+    if (!in->file)
+    {
+        perror("Error opening archive");
+        return 1;
+    }
+    // Pipes can only be read front to back
+    in->seekable = fseeko(in->file, 0, SEEK_CUR) == 0;
+
+    if (read_archive_header(in) != 0)
+    {
+        close_archive(in->file);
+        return 1;
+    }
+    return 0;
+}
+
+
+// Read all entries of an archive and decode their data blocks in parallel. The calling thread reads the archive
+// and queues the blocks, the workers decompress and check them and, when extracting, write them to the files.
+// Returns 0 if every entry was decoded intact
+static int decode_archive(ArchiveStream *in, Options *opts, DecodeMode mode, DecodeTotals *totals)
+{
+    DecodeQueue queue = { .mode = mode, .capacity = opts->threads * QUEUE_DEPTH_PER_THREAD };
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    memset(totals, 0, sizeof(*totals));
+
+    // All buffers are allocated up front and the full queue holds the reader back. With --max-memory the queue
+    // gets fewer slots, down to one per worker, and then fewer workers until the buffers fit
+    uLong compressed_bound = compressBound(DATA_BLOCK_SIZE);
+    uint64_t worker_size = compressed_bound + DATA_BLOCK_SIZE;
+    unsigned int threads = opts->threads;
+    while (opts->max_memory > 0 && queue.capacity > 1 &&
+           threads * worker_size + queue.capacity * compressed_bound > opts->max_memory)
+    {
+        if (queue.capacity == threads)
+        {
+            threads--;
+        }
+        queue.capacity--;
+    }
+
+    // Every queue slot has its own buffer, so the next blocks are read while the workers decode
+    queue.jobs = calloc(queue.capacity, sizeof(DecodeJob));
+    DecodeWorker *workers = calloc(threads, sizeof(DecodeWorker));
+    bool alloc_failed = !queue.jobs || !workers;
+    for (size_t i = 0; !alloc_failed && i < queue.capacity; i++)
+    {
+        alloc_failed = posix_memalign((void **) &queue.jobs[i].data, DIRECT_IO_ALIGN, compressed_bound) != 0;
+    }
+
+    // Start the decode workers, each with a spare slot buffer and a buffer for the decompressed block
+    unsigned int worker_count = 0;
+    while (!alloc_failed && worker_count < threads)
+    {
+        DecodeWorker *worker = &workers[worker_count];
+        worker->queue = &queue;
+        if (posix_memalign((void **) &worker->spare, DIRECT_IO_ALIGN, compressed_bound) != 0 ||
+            posix_memalign((void **) &worker->block, DIRECT_IO_ALIGN, DATA_BLOCK_SIZE) != 0)
+        {
+            free(worker->spare);
+            break;
+        }
+        worker->stream = inflate_stream_init(&worker->inflate_state);
+        if (pthread_create(&worker->thread, NULL, decode_worker, worker) != 0)
+        {
+            perror("Error starting decode worker");
+            free(worker->spare);
+            free(worker->block);
+            if (worker->stream)
+            {
+                inflateEnd(worker->stream);
+            }
+            break;
+        }
+        worker_count++;
+    }
+
+    int ret = 0;
+    DirCache dirs;
+    bool dirs_ready = false;
+    if (alloc_failed || worker_count == 0)
+    {
+        fprintf(stderr, "Error allocating memory for decode workers\n");
+        ret = -1;
+    }
+    else if (mode == DECODE_EXTRACT)
+    {
+        dirs_ready = dir_cache_init(&dirs) == 0;
+        ret = dirs_ready ? 0 : -1;
+    }
+
+    // With --prefix the entries below it are taken from the sorted index and read by seeking from one to the next.
+    // Without an index all entries are read through and the others are skipped
+    uint64_t *selected = NULL;
+    size_t selected_count = 0;
+    size_t next_selected = 0;
+    int select_status = 1;
+    uint64_t matched = 0;
+    if (ret == 0 && opts->prefix && in->seekable)
+    {
+        select_status = find_prefix_entries(in, opts->prefix, &selected, &selected_count);
+        ret = select_status < 0 ? -1 : 0;
+    }
+
+    // While reading archive entry headers (file path, original file size)
+    char file_path[MAX_PATH_LEN + 1];
+    uint64_t original_size;
+    while (ret == 0)
+    {
+        if (select_status == 0)
+        {
+            if (next_selected == selected_count)
+            {
+                break;
+            }
+            uint64_t offset = selected[next_selected++];
+            if (in->offset != offset && fseeko(in->file, offset, SEEK_SET) != 0)
+            {
+                perror("Error reading archive");
+                ret = -1;
+                break;
+            }
+            in->offset = offset;
+        }
+
+        uint16_t flags;
+        int status = read_entry_header(in, file_path, &original_size, &flags);
+        if (status != 1) // The index follows the last entry
+        {
+            ret = status;
+            break;
+        }
+        if (opts->prefix && strncmp(file_path, opts->prefix, strlen(opts->prefix)) != 0)
+        {
+            if (select_status == 0)
+            {
+                fprintf(stderr, "Error: corrupt archive (index does not match entry)\n");
+                ret = -1;
+            }
+            else if (skip_entry_data(in) != 0)
+            {
+                ret = -1;
+            }
+            continue;
+        }
+        matched++;
+
+        // Reuse a released entry, new ones are only allocated while the queue fills up
+        pthread_mutex_lock(&queue.lock);
+        DecodeEntry *entry = queue.free_entries;
+        if (entry)
+        {
+            queue.free_entries = entry->next_free;
+        }
+        pthread_mutex_unlock(&queue.lock);
+        if (!entry && !(entry = calloc(1, sizeof(DecodeEntry))))
+        {
+            perror("Error allocating memory for archive entry");
+            ret = -1;
+            break;
+        }
+        strcpy(entry->file_path, file_path);
+        entry->out = (OutputFile) { .fd = -1, .tail_fd = -1 };
+        entry->original_size = 0;
+        entry->expected_checksum = 0;
+        entry->block_count = 0;
+        entry->error = NULL;
+        entry->pending = 1; // Held by this thread until all blocks are queued
+
+        // Entries whose file can not be created are only read through
+        uint64_t start = mdarc_stats_clock();
+        trace_label(file_path);
+        bool skip = false;
+        bool sparse = flags & ENTRY_FLAG_SPARSE;
+        if (mode == DECODE_EXTRACT && open_entry_file(&dirs, entry, original_size, opts->direct_io, sparse) != 0)
+        {
+            entry->error = "unable to create file";
+            skip = true;
+        }
+        if (queue_entry_blocks(in, &queue, entry, skip) != 0)
+        {
+            ret = -1;
+        }
+        release_entry(&queue, entry);
+        mdarc_trace_span("read entry", start, mdarc_stats_clock());
+    }
+
+    if (ret == 0 && opts->prefix && matched == 0)
+    {
+        fprintf(stderr, "Error: no entries below %s in the archive\n", opts->prefix);
+        ret = 1;
+    }
+
+    // Let the workers finish the queued blocks and exit
+    pthread_mutex_lock(&queue.lock);
+    queue.reading_done = true;
+    pthread_cond_broadcast(&queue.changed);
+    pthread_mutex_unlock(&queue.lock);
+    for (unsigned int i = 0; i < worker_count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].spare);
+        free(workers[i].block);
+        if (workers[i].stream)
+        {
+            inflateEnd(workers[i].stream);
+        }
+    }
+    free(workers);
+    while (queue.free_entries)
+    {
+        DecodeEntry *entry = queue.free_entries;
+        queue.free_entries = entry->next_free;
+        free(entry->blocks);
+        free(entry);
+    }
+    for (size_t i = 0; queue.jobs && i < queue.capacity; i++)
+    {
+        free(queue.jobs[i].data);
+    }
+    free(queue.jobs);
+    free(selected);
+    if (dirs_ready)
+    {
+        dir_cache_free(&dirs);
+    }
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.changed);
+    if (opts->max_memory > 0)
+    {
+        print_memory_peak(worker_count * worker_size + queue.capacity * compressed_bound, opts->max_memory);
+    }
+
+    *totals = queue.totals;
+    return ret != 0 || queue.totals.errors > 0;
+}
+
+
+// Decode worker thread. Takes the oldest queued block, leaving its spare buffer in the slot for the reader
+static void *decode_worker(void *arg)
+{
+    DecodeWorker *worker = arg;
+    DecodeQueue *queue = worker->queue;
+    mdarc_trace_thread("decode worker");
+    while (true)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0 && !queue->reading_done)
+        {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        if (queue->count == 0)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        DecodeJob job = queue->jobs[queue->head];
+        queue->jobs[queue->head].data = worker->spare;
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+
+        worker->spare = job.data;
+        decode_block(queue, &job, worker->block, worker->stream);
+    }
+    return NULL;
+}
+
+
+// Decompress a block, compute its checksum and write it to its place in the extracted file
+static void decode_block(DecodeQueue *queue, DecodeJob *job, unsigned char *block, z_stream *stream)
+{
+    DecodeEntry *entry = job->entry;
+    const char *error = NULL;
+    const unsigned char *data = job->data;
+    trace_label(entry->file_path);
+
+    // Blocks of the same size as the original data are stored uncompressed
+    if (job->len < job->original_len)
+    {
+        if (decompress_block(stream, job->data, job->len, block, job->original_len) != 0)
+        {
+            error = "decompression failed";
+        }
+        data = block;
+    }
+    uint32_t checksum = 0;
+    if (!error)
+    {
+        uint64_t start = mdarc_stats_clock();
+        checksum = crc32c(0, data, job->original_len);
+        mdarc_stats_add(STAT_CHECKSUM, start, 1, job->original_len);
+        if (queue->mode == DECODE_EXTRACT && entry->out.fd != -1 &&
+            write_output(&entry->out, data, job->original_len, job->offset) != 0)
+        {
+            error = "write failed";
+        }
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    entry->blocks[job->block_index].checksum = checksum;
+    if (error && !entry->error)
+    {
+        entry->error = error;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    release_entry(queue, entry);
+}
+
+
+// Read the data blocks of an entry into the queue, then check the data descriptor against them. Returns 1 if
+// the archive can not be read any further
+static int queue_entry_blocks(ArchiveStream *in, DecodeQueue *queue, DecodeEntry *entry, bool skip)
+{
+    uint64_t original_size = 0;
+    uint64_t compressed_size = 0;
+    while (true)
+    {
+        unsigned char block_header[BLOCK_HEADER_SIZE];
+        if (read_bytes(in, block_header, BLOCK_HEADER_SIZE) != 0)
+        {
+            set_entry_error(queue, entry, "unexpected end of archive");
+            return 1;
+        }
+        uint32_t original_len = get_u32(block_header);
+        uint32_t len = get_u32(block_header + 4);
+        if (original_len == 0 && len == 0) // End of the entry data
+        {
+            break;
+        }
+        // Blocks are never larger than DATA_BLOCK_SIZE and never grow when compressed
+        bool hole = len == 0;
+        if (!hole && (original_len > DATA_BLOCK_SIZE || len > original_len))
+        {
+            fprintf(stderr, "Error: corrupt archive (invalid block header)\n");
+            set_entry_error(queue, entry, "corrupt archive");
+            return 1;
+        }
+
+        if (hole)
+        {
+            // Holes are not written, only their zeros are added to the checksum
+            if (add_hole_block(queue, entry, original_len) != 0)
+            {
+                return 1;
+            }
+        }
+        else if (skip)
+        {
+            if (skip_bytes(in, len) != 0)
+            {
+                return 1;
+            }
+        }
+        else
+        {
+            // Wait for a free slot. Only this thread fills slots, so the one at the end of the queue stays free
+            pthread_mutex_lock(&queue->lock);
+            while (queue->count == queue->capacity)
+            {
+                pthread_cond_wait(&queue->changed, &queue->lock);
+            }
+            if (grow_entry_blocks(entry) != 0)
+            {
+                pthread_mutex_unlock(&queue->lock);
+                set_entry_error(queue, entry, "out of memory");
+                return 1;
+            }
+            DecodeJob *slot = &queue->jobs[(queue->head + queue->count) % queue->capacity];
+            pthread_mutex_unlock(&queue->lock);
+
+            if (read_bytes(in, slot->data, len) != 0)
+            {
+                set_entry_error(queue, entry, "unexpected end of archive");
+                return 1;
+            }
+
+            pthread_mutex_lock(&queue->lock);
+            slot->entry = entry;
+            slot->block_index = entry->block_count;
+            slot->offset = original_size;
+            slot->original_len = original_len;
+            slot->len = len;
+            entry->blocks[entry->block_count].len = original_len;
+            entry->block_count++;
+            entry->pending++;
+            queue->count++;
+            pthread_cond_broadcast(&queue->changed);
+            pthread_mutex_unlock(&queue->lock);
+        }
+        original_size += original_len;
+        compressed_size += len;
+    }
+
+    // Check the data descriptor against what was actually read
+    unsigned char descriptor[DESCRIPTOR_SIZE];
+    if (read_bytes(in, descriptor, DESCRIPTOR_SIZE) != 0)
+    {
+        set_entry_error(queue, entry, "unexpected end of archive");
+        return 1;
+    }
+    if (get_u32(descriptor) != DESCRIPTOR_SIGNATURE || get_u64(descriptor + 4) != original_size ||
+        get_u64(descriptor + 12) != compressed_size)
+    {
+        fprintf(stderr, "Error: corrupt archive (data descriptor does not match entry data)\n");
+        set_entry_error(queue, entry, "corrupt archive");
+        return 1;
+    }
+    pthread_mutex_lock(&queue->lock);
+    entry->original_size = original_size;
+    entry->expected_checksum = get_u32(descriptor + 20);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+
+// Add the checksum of a hole block to the blocks of an entry
+static int add_hole_block(DecodeQueue *queue, DecodeEntry *entry, uint32_t len)
+{
+    uint32_t checksum = crc32c_append_zeros(0, len);
+    pthread_mutex_lock(&queue->lock);
+    int ret = grow_entry_blocks(entry);
+    if (ret == 0)
+    {
+        entry->blocks[entry->block_count].checksum = checksum;
+        entry->blocks[entry->block_count].len = len;
+        entry->block_count++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (ret != 0)
+    {
+        set_entry_error(queue, entry, "out of memory");
+    }
+    return ret;
+}
+
+
+// Make room for one more block checksum, called with queue->lock held
+static int grow_entry_blocks(DecodeEntry *entry)
+{
+    if (entry->block_count < entry->block_capacity)
+    {
+        return 0;
+    }
+    size_t capacity = entry->block_capacity ? 2 * entry->block_capacity : 16;
+    DecodeBlock *blocks = realloc(entry->blocks, capacity * sizeof(DecodeBlock));
+    if (!blocks)
+    {
+        perror("Error allocating memory for archive entry");
+        return 1;
+    }
+    entry->blocks = blocks;
+    entry->block_capacity = capacity;
+    return 0;
+}
+
+
+static void set_entry_error(DecodeQueue *queue, DecodeEntry *entry, const char *error)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (!entry->error)
+    {
+        entry->error = error;
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+// Drop one reference to an entry. The last one, from the reader or from the worker of its last block to finish,
+// checks the entry and closes its file
+static void release_entry(DecodeQueue *queue, DecodeEntry *entry)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool finished = --entry->pending == 0;
+    pthread_mutex_unlock(&queue->lock);
+    if (!finished)
+    {
+        return;
+    }
+
+    // Join the block checksums in file order into the checksum of the whole file
+    if (!entry->error && entry->block_count > 0)
+    {
+        uint32_t checksum = entry->blocks[0].checksum;
+        for (size_t i = 1; i < entry->block_count; i++)
+        {
+            checksum = crc32c_combine(checksum, entry->blocks[i].checksum, entry->blocks[i].len);
+        }
+        if (checksum != entry->expected_checksum)
+        {
+            entry->error = "checksum mismatch, data is corrupt";
+        }
+    }
+    else if (!entry->error && entry->expected_checksum != 0)
+    {
+        entry->error = "checksum mismatch, data is corrupt";
+    }
+    if (entry->out.fd != -1 && close_output_file(&entry->out, entry->original_size) != 0 && !entry->error)
+    {
+        entry->error = "write failed";
+    }
+    if (entry->error)
+    {
+        fprintf(stderr, "Error %s %s: %s\n", queue->mode == DECODE_EXTRACT ? "extracting" : "testing",
+                entry->file_path, entry->error);
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->totals.files++;
+    queue->totals.bytes += entry->original_size;
+    if (entry->error)
+    {
+        queue->totals.errors++;
+    }
+    entry->next_free = queue->free_entries;
+    queue->free_entries = entry;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+// Read over the data blocks and the data descriptor of an entry without decoding them
+static int skip_entry_data(ArchiveStream *in)
+{
+    uint64_t original_size = 0;
+    uint64_t compressed_size = 0;
+    while (true)
+    {
+        unsigned char block_header[BLOCK_HEADER_SIZE];
+        if (read_bytes(in, block_header, BLOCK_HEADER_SIZE) != 0)
+        {
+            return 1;
+        }
+        uint32_t original_len = get_u32(block_header);
+        uint32_t len = get_u32(block_header + 4);
+        if (original_len == 0 && len == 0) // End of the entry data
+        {
+            break;
+        }
+        if (len != 0 && (original_len > DATA_BLOCK_SIZE || len > original_len))
+        {
+            fprintf(stderr, "Error: corrupt archive (invalid block header)\n");
+            return 1;
+        }
+        if (skip_bytes(in, len) != 0)
+        {
+            return 1;
+        }
+        original_size += original_len;
+        compressed_size += len;
+    }
+
+    unsigned char descriptor[DESCRIPTOR_SIZE];
+    if (read_bytes(in, descriptor, DESCRIPTOR_SIZE) != 0)
+    {
+        return 1;
+    }
+    if (get_u32(descriptor) != DESCRIPTOR_SIGNATURE || get_u64(descriptor + 4) != original_size ||
+        get_u64(descriptor + 12) != compressed_size)
+    {
+        fprintf(stderr, "Error: corrupt archive (data descriptor does not match entry data)\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+// Decompress the data blocks of an entry one at a time and write them to out, then check the data descriptor.
+// block and compressed_block are buffers of DATA_BLOCK_SIZE and compressBound(DATA_BLOCK_SIZE) bytes
+static int write_entry_data(ArchiveStream *in, FILE *out, unsigned char *block, unsigned char *compressed_block,
+                            z_stream *stream)
+{
+    uint64_t original_size = 0;
+    uint64_t compressed_size = 0;
+    uint32_t checksum = 0;
+    uint32_t original_len, len;
+    int ret;
+    while ((ret = read_data_block(in, block, compressed_block, stream, &original_len, &len)) > 0)
+    {
+        if (ret == 2)
+        {
+            // Holes of sparse files are written as zeros, one block buffer at a time
+            checksum = crc32c_append_zeros(checksum, original_len);
+            memset(block, 0, DATA_BLOCK_SIZE);
+            for (uint32_t left = original_len; left > 0;)
+            {
+                uint32_t chunk = left < DATA_BLOCK_SIZE ? left : DATA_BLOCK_SIZE;
+                if (fwrite(block, 1, chunk, out) != chunk)
+                {
+                    perror("Error writing output");
+                    return 1;
+                }
+                left -= chunk;
+            }
+        }
+        else
+        {
+            checksum = crc32c(checksum, block, original_len);
+            if (fwrite(block, 1, original_len, out) != original_len)
+            {
+                perror("Error writing output");
+                return 1;
+            }
+        }
+        original_size += original_len;
+        compressed_size += len;
+    }
+    if (ret < 0)
+    {
+        return 1;
+    }
+    // The data is already written, so a damaged file can only be reported afterwards
+    return check_data_descriptor(in, original_size, compressed_size, checksum);
+}
+
+
+// Read the next data block of an entry and decompress it into block. Returns 1 for a block, 2 for a hole block
+// (original_len zero bytes, nothing read into block), 0 at the end of the entry data and -1 on errors
+static int read_data_block(ArchiveStream *in, unsigned char *block, unsigned char *compressed_block, z_stream *stream,
+                           uint32_t *original_len, uint32_t *len)
+{
+    unsigned char block_header[BLOCK_HEADER_SIZE];
+    if (read_bytes(in, block_header, BLOCK_HEADER_SIZE) != 0)
+    {
+        return -1;
+    }
+    *original_len = get_u32(block_header);
+    *len = get_u32(block_header + 4);
+    if (*original_len == 0 && *len == 0) // End of the entry data
+    {
+        return 0;
+    }
+    if (*len == 0)
+    {
+        return 2;
+    }
+    if (*original_len > DATA_BLOCK_SIZE || *len > *original_len)
+    {
+        fprintf(stderr, "Error: corrupt archive (invalid block header)\n");
+        return -1;
+    }
+
+    // Blocks of the same size as the original data are stored uncompressed
+    if (read_bytes(in, *len == *original_len ? block : compressed_block, *len) != 0)
+    {
+        return -1;
+    }
+    if (*len < *original_len)
+    {
+        if (decompress_block(stream, compressed_block, *len, block, *original_len) != 0)
+        {
+            fprintf(stderr, "Error decompressing file\n");
+            return -1;
+        }
+    }
+    return 1;
+}
+
+
+// Read the data descriptor after the blocks of an entry and check it against what was actually read
+static int check_data_descriptor(ArchiveStream *in, uint64_t original_size, uint64_t compressed_size, uint32_t checksum)
+{
+    unsigned char descriptor[DESCRIPTOR_SIZE];
+    if (read_bytes(in, descriptor, DESCRIPTOR_SIZE) != 0)
+    {
+        return 1;
+    }
+    if (get_u32(descriptor) != DESCRIPTOR_SIGNATURE || get_u64(descriptor + 4) != original_size ||
+        get_u64(descriptor + 12) != compressed_size)
+    {
+        fprintf(stderr, "Error: corrupt archive (data descriptor does not match entry data)\n");
+        return 1;
+    }
+    if (get_u32(descriptor + 20) != checksum)
+    {
+        fprintf(stderr, "Error: checksum mismatch, data is corrupt\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+// Create the missing directories and the file of an entry being extracted
+static int open_entry_file(DirCache *dirs, DecodeEntry *entry, uint64_t size, bool direct_io, bool sparse)
+{
+    // Paths that would leave the current directory are not extracted
+    if (!is_safe_path(entry->file_path))
+    {
+        fprintf(stderr, "Error: unsafe file path in archive, skipping %s\n", entry->file_path);
+        return 1;
+    }
+
+    // Validate file path exists and recreate any missing subdirectorie if necessary
+    int dir_fd;
+    uint64_t start = mdarc_stats_clock();
+    int ret = validate_file_path(dirs, entry->file_path, &dir_fd);
+    mdarc_stats_add(STAT_MKDIR, start, 1, 0);
+    if (ret != 0)
+    {
+        perror("Unable to create directory structure");
+        return 1;
+    }
+
+    const char *name = strrchr(entry->file_path, '/');
+    name = name ? name + 1 : entry->file_path;
+    start = mdarc_stats_clock();
+    ret = create_output_file(&entry->out, dir_fd, name, size, direct_io, sparse);
+    mdarc_stats_add(STAT_CREATE, start, 1, 0);
+    if (ret != 0)
+    {
+        perror("Error creating file");
+        return 1;
+    }
+    return 0;
+}
+
+
+// Create an extracted file and reserve its final size up front, so the file system can allocate it in one piece
+// instead of growing it as the data arrives. With --direct-io large files are opened with O_DIRECT. Sparse files
+// are not preallocated, their holes are left unwritten and the size is set when the file is closed
+static int create_output_file(OutputFile *out, int dir_fd, const char *name, uint64_t size, bool direct_io, bool sparse)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    out->fd = -1;
+    out->tail_fd = -1;
+    out->preallocated = 0;
+    out->direct = false;
+    out->sparse = sparse;
+
+#ifdef O_DIRECT
+    if (direct_io && size >= DIRECT_IO_MIN_SIZE)
+    {
+        // Not every file system supports O_DIRECT, fall back to a regular open in that case. The unaligned end of
+        // the file is written through a second descriptor, the workers share fd and its flags are never changed
+        out->fd = openat(dir_fd, name, flags | O_DIRECT, 0666);
+        if (out->fd != -1)
+        {
+            out->tail_fd = openat(dir_fd, name, O_WRONLY | O_CLOEXEC);
+            if (out->tail_fd == -1)
+            {
+                close(out->fd);
+                out->fd = -1;
+            }
+        }
+        out->direct = out->fd != -1;
+    }
+#else
+    (void) direct_io;
+#endif
+    if (out->fd == -1)
+    {
+        out->fd = openat(dir_fd, name, flags, 0666);
+        if (out->fd == -1)
+        {
+            return 1;
+        }
+    }
+
+#ifdef __linux__
+    // Preallocation is only a hint, file systems without fallocate() support just grow the file
+    if (size > 0 && !sparse && fallocate(out->fd, 0, 0, size) == 0)
+    {
+        out->preallocated = size;
+    }
+#endif
+    return 0;
+}
+
+
+// Write a decoded block at its position in an extracted file. The workers write the blocks of a file in any order
+static int write_output(OutputFile *out, const unsigned char *data, size_t len, uint64_t offset)
+{
+    uint64_t start = mdarc_stats_clock();
+    uint64_t total = len;
+    // Only whole multiples of DIRECT_IO_ALIGN can be written with O_DIRECT, the unaligned end of the file is
+    // written through the page cache
+    int fd = out->fd;
+    if (out->direct && (len % DIRECT_IO_ALIGN != 0 || offset % DIRECT_IO_ALIGN != 0))
+    {
+        fd = out->tail_fd;
+    }
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error writing file");
+            return 1;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    mdarc_stats_add(STAT_WRITE_FILES, start, 1, total);
+    return 0;
+}
+
+
+// Close an extracted file of the given final size
+static int close_output_file(OutputFile *out, uint64_t size)
+{
+    uint64_t start = mdarc_stats_clock();
+    int ret = 0;
+    // Cut off preallocated space the data did not fill, e.g. a file that shrank while it was archived. A sparse
+    // file ending in a hole gets its full size here
+    if ((out->preallocated > size || out->sparse) && ftruncate(out->fd, size) != 0)
+    {
+        perror("Error writing file");
+        ret = 1;
+    }
+    if (out->tail_fd != -1 && close(out->tail_fd) != 0)
+    {
+        perror("Error writing file");
+        ret = 1;
+    }
+    if (close(out->fd) != 0)
+    {
+        perror("Error writing file");
+        ret = 1;
+    }
+    out->fd = -1;
+    out->tail_fd = -1;
+    mdarc_stats_add(STAT_WRITE_FILES, start, 0, 0);
+    return ret;
+}
+
+
+static int write_archive_header(ArchiveStream *out)
+{
+    unsigned char header[ARCHIVE_HEADER_SIZE] = ARCHIVE_MAGIC;
+    header[6] = FORMAT_VERSION;
+    header[7] = 0; // reserved
+    return write_bytes(out, header, ARCHIVE_HEADER_SIZE);
+}
+
+
+static int read_archive_header(ArchiveStream *in)
+{
+    unsigned char header[ARCHIVE_HEADER_SIZE];
+    if (read_bytes(in, header, ARCHIVE_HEADER_SIZE) != 0)
+    {
+        return 1;
+    }
+    if (memcmp(header, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0)
+    {
+        fprintf(stderr, "Error: not an mdarc archive, or created by a version older than v0.6\n");
+        return 1;
+    }
+    if (header[6] != FORMAT_VERSION)
+    {
+        fprintf(stderr, "Error: unsupported archive format version %d\n", header[6]);
+        return 1;
+    }
+    return 0;
+}
+
+
+// Write the index of all written entries, the root table of its blocks and the trailer pointing to the root table.
+// The entries are sorted into index order (compare_index_path), also when the data was written in physical order
+// (--read-order), and split into blocks of whole directories where possible. Every record keeps the position of its
+// entry in the original file list, which listing uses
+static int write_archive_index(ArchiveStream *out, Options *opts)
+{
+    unsigned char header[ROOT_HEADER_SIZE];
+    put_u32(header, INDEX_SIGNATURE);
+    if (write_bytes(out, header, 4) != 0)
+    {
+        return 1;
+    }
+
+    // Every block but the last has at least INDEX_BLOCK_MIN_ENTRIES entries
+    size_t max_entries = opts->file_count ? opts->file_count : 1;
+    FileNode **entries = malloc(max_entries * sizeof(FileNode *));
+    IndexBlock *blocks = malloc((max_entries / INDEX_BLOCK_MIN_ENTRIES + 1) * sizeof(IndexBlock));
+    if (!entries || !blocks)
+    {
+        perror("Error allocating memory for archive index");
+        free(entries);
+        free(blocks);
+        return 1;
+    }
+    uint64_t entry_count = 0;
+    for (FileNode *node = opts->file_list; node != NULL; node = node->next)
+    {
+        if (node->status == ENTRY_WRITTEN)
+        {
+            entries[entry_count++] = node;
+        }
+    }
+    qsort(entries, entry_count, sizeof(FileNode *), compare_index_order);
+
+    // Cut the sorted entries into blocks, at a directory change once a block has enough entries
+    int ret = 0;
+    uint32_t block_count = 0;
+    unsigned char *buffer = NULL;
+    size_t buffer_capacity = 0;
+    uint64_t first = 0;
+    for (uint64_t i = 1; i <= entry_count && ret == 0; i++)
+    {
+        uint64_t count = i - first;
+        if (i < entry_count && count < INDEX_BLOCK_ENTRIES &&
+            (count < INDEX_BLOCK_MIN_ENTRIES || same_directory(entries[i - 1]->archive_path, entries[i]->archive_path)))
+        {
+            continue;
+        }
+        ret = write_index_block(out, entries + first, count, &blocks[block_count++], &buffer, &buffer_capacity);
+        first = i;
+    }
+    free(buffer);
+
+    // The root table lists the blocks in index order, with the path of their first entry
+    uint64_t root_offset = out->offset;
+    put_u32(header, ROOT_SIGNATURE);
+    put_u32(header + 4, block_count);
+    if (ret == 0)
+    {
+        ret = write_bytes(out, header, ROOT_HEADER_SIZE);
+    }
+    unsigned char record[ROOT_RECORD_SIZE];
+    for (uint32_t i = 0; i < block_count && ret == 0; i++)
+    {
+        size_t path_len = strlen(blocks[i].first_path);
+        put_u64(record, blocks[i].offset);
+        put_u32(record + 8, blocks[i].stored_len);
+        put_u32(record + 12, blocks[i].original_len);
+        put_u32(record + 16, blocks[i].entry_count);
+        put_u16(record + 20, path_len);
+        ret = write_bytes(out, record, ROOT_RECORD_SIZE) != 0 || write_bytes(out, blocks[i].first_path, path_len) != 0;
+    }
+    free(entries);
+    free(blocks);
+    if (ret != 0)
+    {
+        return 1;
+    }
+
+    unsigned char trailer[TRAILER_SIZE];
+    put_u32(trailer, TRAILER_SIGNATURE);
+    put_u64(trailer + 4, root_offset);
+    put_u64(trailer + 12, entry_count);
+    return write_bytes(out, trailer, TRAILER_SIZE);
+}
+
+
+// Write the index records of count entries as one deflated block and fill in its root table record. Every path
+// is front coded, stored as the length of the prefix it shares with the previous path and the rest of it. buffer
+// holds the records and the deflated block and grows as needed
+static int write_index_block(ArchiveStream *out, FileNode **entries, uint32_t count, IndexBlock *block,
+                             unsigned char **buffer, size_t *capacity)
+{
+    size_t len = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        len += INDEX_RECORD_SIZE + strlen(entries[i]->archive_path);
+    }
+    uLongf stored_len = compressBound(len);
+    if (len + stored_len > *capacity)
+    {
+        unsigned char *new_buffer = realloc(*buffer, len + stored_len);
+        if (!new_buffer)
+        {
+            perror("Error allocating memory for archive index");
+            return 1;
+        }
+        *buffer = new_buffer;
+        *capacity = len + stored_len;
+    }
+
+    unsigned char *record = *buffer;
+    const char *previous = "";
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char *path = entries[i]->archive_path;
+        size_t prefix_len = 0;
+        while (path[prefix_len] != '\0' && path[prefix_len] == previous[prefix_len])
+        {
+            prefix_len++;
+        }
+        size_t suffix_len = strlen(path + prefix_len);
+        put_u64(record, entries[i]->header_offset);
+        put_u64(record + 8, entries[i]->original_size);
+        put_u64(record + 16, entries[i]->compressed_size);
+        put_u32(record + 24, entries[i]->checksum);
+        put_u64(record + 28, entries[i]->list_index);
+        put_u16(record + 36, prefix_len);
+        put_u16(record + 38, suffix_len);
+        memcpy(record + INDEX_RECORD_SIZE, path + prefix_len, suffix_len);
+        record += INDEX_RECORD_SIZE + suffix_len;
+        previous = path;
+    }
+    len = record - *buffer;
+    if (compress(*buffer + len, &stored_len, *buffer, len) != Z_OK)
+    {
+        fprintf(stderr, "Error compressing archive index\n");
+        return 1;
+    }
+
+    block->offset = out->offset;
+    block->stored_len = stored_len;
+    block->original_len = len;
+    block->entry_count = count;
+    block->first_path = (char *) entries[0]->archive_path; // Only read while the index is written
+    return write_bytes(out, *buffer + len, stored_len);
+}
+
+
+// Print the file paths from the index at the end of a seekable archive that start with prefix ("" for all of
+// them), in the order of the original file list. The matching paths are one range of the sorted index, only its
+// blocks are read. Returns 1 without printing anything if the archive has no valid trailer, after seeking back to
+// the first entry, and -1 without printing anything if the index can not be read
+static int list_archive_index(ArchiveStream *in, const char *prefix)
+{
+    ArchiveIndex index;
+    int ret = open_archive_index(in, &index);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    // Collect the matching entries with a copy of their path, the loaded block is replaced by the next one
+    IndexEntry *entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint32_t block;
+    uint32_t entry;
+    size_t prefix_len = strlen(prefix);
+    ret = index_lower_bound(&index, prefix, &block, &entry) == 0 ? 0 : -1;
+    bool in_range = ret == 0;
+    for (; in_range && block < index.block_count; block++, entry = 0)
+    {
+        if (load_index_block(&index, block) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        for (; in_range && entry < index.blocks[block].entry_count; entry++)
+        {
+            in_range = strncmp(index.entries[entry].path, prefix, prefix_len) == 0;
+            if (!in_range)
+            {
+                break;
+            }
+            if (count == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 64;
+                IndexEntry *new_entries = realloc(entries, capacity * sizeof(IndexEntry));
+                if (!new_entries)
+                {
+                    perror("Error allocating memory for archive index");
+                    ret = -1;
+                    in_range = false;
+                    break;
+                }
+                entries = new_entries;
+            }
+            entries[count] = index.entries[entry];
+            entries[count].path = strdup(index.entries[entry].path);
+            if (!entries[count].path)
+            {
+                perror("Error allocating memory for archive index");
+                ret = -1;
+                in_range = false;
+                break;
+            }
+            count++;
+        }
+    }
+    close_archive_index(&index);
+
+    // A partial listing is not printed
+    if (ret == 0)
+    {
+        qsort(entries, count, sizeof(IndexEntry), compare_list_index);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (ret == 0)
+        {
+            printf("%s\n", entries[i].path);
+        }
+        free(entries[i].path);
+    }
+    free(entries);
+    return ret;
+}
+
+
+// Collect the archive offsets of the entries whose path starts with prefix, from their range of the sorted index.
+// The offsets are sorted, so the entries are then read front to back. Returns 1 if the archive has no index, after
+// seeking back to the first entry, and -1 on errors
+static int find_prefix_entries(ArchiveStream *in, const char *prefix, uint64_t **offsets, size_t *count)
+{
+    ArchiveIndex index;
+    int ret = open_archive_index(in, &index);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    *offsets = NULL;
+    *count = 0;
+    size_t capacity = 0;
+    uint32_t block;
+    uint32_t entry;
+    size_t prefix_len = strlen(prefix);
+    bool in_range = true;
+    ret = index_lower_bound(&index, prefix, &block, &entry) == 0 ? 0 : -1;
+    for (; ret == 0 && in_range && block < index.block_count; block++, entry = 0)
+    {
+        if (load_index_block(&index, block) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        for (; in_range && entry < index.blocks[block].entry_count; entry++)
+        {
+            in_range = strncmp(index.entries[entry].path, prefix, prefix_len) == 0;
+            if (!in_range)
+            {
+                break;
+            }
+            if (*count == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 64;
+                uint64_t *new_offsets = realloc(*offsets, capacity * sizeof(uint64_t));
+                if (!new_offsets)
+                {
+                    perror("Error allocating memory for archive index");
+                    ret = -1;
+                    break;
+                }
+                *offsets = new_offsets;
+            }
+            (*offsets)[(*count)++] = index.entries[entry].header_offset;
+        }
+    }
+    close_archive_index(&index);
+    if (ret != 0)
+    {
+        free(*offsets);
+        *offsets = NULL;
+        *count = 0;
+        return ret;
+    }
+    qsort(*offsets, *count, sizeof(uint64_t), compare_u64);
+    return 0;
+}
+
+
+// Read the root table of the index of a seekable archive. Returns 1 if the archive has no valid trailer, after
+// seeking back to the first entry, and -1 if the trailer points to a corrupt root table
+static int open_archive_index(ArchiveStream *in, ArchiveIndex *index)
+{
+    memset(index, 0, sizeof(ArchiveIndex));
+    index->in = in;
+
+    unsigned char trailer[TRAILER_SIZE];
+    if (fseeko(in->file, -TRAILER_SIZE, SEEK_END) != 0 || fread(trailer, 1, TRAILER_SIZE, in->file) != TRAILER_SIZE ||
+        get_u32(trailer) != TRAILER_SIGNATURE)
+    {
+        fprintf(stderr, "Warning: archive index not found, reading through the archive\n");
+        fseeko(in->file, ARCHIVE_HEADER_SIZE, SEEK_SET);
+        in->offset = ARCHIVE_HEADER_SIZE;
+        return 1;
+    }
+    uint64_t root_offset = get_u64(trailer + 4);
+    index->entry_count = get_u64(trailer + 12);
+
+    unsigned char header[ROOT_HEADER_SIZE];
+    if (fseeko(in->file, root_offset, SEEK_SET) != 0 || fread(header, 1, ROOT_HEADER_SIZE, in->file) !=
+        ROOT_HEADER_SIZE || get_u32(header) != ROOT_SIGNATURE || get_u32(header + 4) > index->entry_count)
+    {
+        fprintf(stderr, "Error: corrupt archive (invalid index offset)\n");
+        return -1;
+    }
+    in->offset = root_offset + ROOT_HEADER_SIZE;
+    index->block_count = get_u32(header + 4);
+    index->loaded = index->block_count;
+    index->blocks = calloc(index->block_count ? index->block_count : 1, sizeof(IndexBlock));
+    if (!index->blocks)
+    {
+        perror("Error allocating memory for archive index");
+        return -1;
+    }
+
+    unsigned char record[ROOT_RECORD_SIZE];
+    uint64_t entry_count = 0;
+    for (uint32_t i = 0; i < index->block_count; i++)
+    {
+        IndexBlock *block = &index->blocks[i];
+        if (read_bytes(in, record, ROOT_RECORD_SIZE) != 0)
+        {
+            close_archive_index(index);
+            return -1;
+        }
+        block->offset = get_u64(record);
+        block->stored_len = get_u32(record + 8);
+        block->original_len = get_u32(record + 12);
+        block->entry_count = get_u32(record + 16);
+        size_t path_len = get_u16(record + 20);
+        entry_count += block->entry_count;
+        if (path_len == 0 || path_len > MAX_PATH_LEN || block->entry_count == 0 ||
+            (uint64_t) block->entry_count * INDEX_RECORD_SIZE > block->original_len)
+        {
+            fprintf(stderr, "Error: corrupt archive (invalid index root table)\n");
+            close_archive_index(index);
+            return -1;
+        }
+        block->first_path = malloc(path_len + 1);
+        if (!block->first_path)
+        {
+            perror("Error allocating memory for archive index");
+            close_archive_index(index);
+            return -1;
+        }
+        if (read_bytes(in, block->first_path, path_len) != 0)
+        {
+            close_archive_index(index);
+            return -1;
+        }
+        block->first_path[path_len] = '\0';
+    }
+    if (entry_count != index->entry_count)
+    {
+        fprintf(stderr, "Error: corrupt archive (invalid index root table)\n");
+        close_archive_index(index);
+        return -1;
+    }
+    return 0;
+}
+
+
+static void close_archive_index(ArchiveIndex *index)
+{
+    for (uint32_t i = 0; i < index->block_count && index->blocks; i++)
+    {
+        free(index->blocks[i].first_path);
+    }
+    free(index->blocks);
+    free(index->entries);
+    free(index->paths);
+    free(index->data);
+    free(index->stored);
+    memset(index, 0, sizeof(ArchiveIndex));
+}
+
+
+// Grow a buffer of the index to hold at least size bytes. Returns 1 if out of memory
+static int grow_index_buffer(void **buffer, size_t *capacity, size_t size)
+{
+    if (size <= *capacity)
+    {
+        return 0;
+    }
+    void *new_buffer = realloc(*buffer, size);
+    if (!new_buffer)
+    {
+        perror("Error allocating memory for archive index");
+        return 1;
+    }
+    *buffer = new_buffer;
+    *capacity = size;
+    return 0;
+}
+
+
+// Read and inflate an index block into index->entries, unless it is loaded already. Returns 1 on errors
+static int load_index_block(ArchiveIndex *index, uint32_t block)
+{
+    if (index->loaded == block)
+    {
+        return 0;
+    }
+    index->loaded = index->block_count;
+
+    IndexBlock *ref = &index->blocks[block];
+    if (grow_index_buffer((void **) &index->stored, &index->stored_capacity, ref->stored_len) != 0 ||
+        grow_index_buffer((void **) &index->data, &index->data_capacity, ref->original_len) != 0 ||
+        grow_index_buffer((void **) &index->entries, &index->entries_capacity, ref->entry_count * sizeof(IndexEntry))
+        != 0)
+    {
+        return 1;
+    }
+    if (fseeko(index->in->file, ref->offset, SEEK_SET) != 0)
+    {
+        perror("Error reading archive");
+        return 1;
+    }
+    index->in->offset = ref->offset;
+    if (read_bytes(index->in, index->stored, ref->stored_len) != 0)
+    {
+        return 1;
+    }
+    uLongf len = ref->original_len;
+    if (uncompress(index->data, &len, index->stored, ref->stored_len) != Z_OK || len != ref->original_len)
+    {
+        fprintf(stderr, "Error: corrupt archive (invalid index block)\n");
+        return 1;
+    }
+
+    // Check the records and add up the length of the full paths, before they are put together
+    const unsigned char *record = index->data;
+    const unsigned char *end = index->data + len;
+    size_t previous_len = 0;
+    size_t paths_len = 0;
+    for (uint32_t i = 0; i < ref->entry_count; i++)
+    {
+        size_t prefix_len = end - record >= INDEX_RECORD_SIZE ? get_u16(record + 36) : 0;
+        size_t suffix_len = end - record >= INDEX_RECORD_SIZE ? get_u16(record + 38) : 0;
+        if ((size_t) (end - record) < INDEX_RECORD_SIZE + suffix_len || prefix_len > previous_len ||
+            prefix_len + suffix_len == 0 || prefix_len + suffix_len > MAX_PATH_LEN ||
+            memchr(record + INDEX_RECORD_SIZE, '\0', suffix_len))
+        {
+            fprintf(stderr, "Error: corrupt archive (invalid index record)\n");
+            return 1;
+        }
+        previous_len = prefix_len + suffix_len;
+        paths_len += previous_len + 1;
+        record += INDEX_RECORD_SIZE + suffix_len;
+    }
+    if (record != end)
+    {
+        fprintf(stderr, "Error: corrupt archive (invalid index block)\n");
+        return 1;
+    }
+    if (grow_index_buffer((void **) &index->paths, &index->paths_capacity, paths_len) != 0)
+    {
+        return 1;
+    }
+
+    // Every path is its shared prefix copied from the previous path, followed by its suffix
+    record = index->data;
+    char *path = index->paths;
+    const char *previous = NULL;
+    for (uint32_t i = 0; i < ref->entry_count; i++)
+    {
+        size_t prefix_len = get_u16(record + 36);
+        size_t suffix_len = get_u16(record + 38);
+        IndexEntry *entry = &index->entries[i];
+        entry->header_offset = get_u64(record);
+        entry->original_size = get_u64(record + 8);
+        entry->compressed_size = get_u64(record + 16);
+        entry->checksum = get_u32(record + 24);
+        entry->list_index = get_u64(record + 28);
+        entry->path = path;
+        if (prefix_len > 0)
+        {
+            memcpy(path, previous, prefix_len);
+        }
+        memcpy(path + prefix_len, record + INDEX_RECORD_SIZE, suffix_len);
+        path[prefix_len + suffix_len] = '\0';
+        previous = path;
+        path += prefix_len + suffix_len + 1;
+        record += INDEX_RECORD_SIZE + suffix_len;
+    }
+    index->loaded = block;
+    return 0;
+}
+
+
+// Find the index block a file path belongs in, the last one whose first path does not come after it. Returns 0 if
+// the path comes before the first block
+static int find_index_block(ArchiveIndex *index, const char *file_path, uint32_t *block)
+{
+    uint32_t low = 0;
+    uint32_t high = index->block_count;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (compare_index_path(index->blocks[middle].first_path, file_path) <= 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low == 0)
+    {
+        return 0;
+    }
+    *block = low - 1;
+    return 1;
+}
+
+
+// Find the position of the first entry of the index that does not come before file_path, loading the index block
+// it is in. block is block_count if all entries come before it. Returns 1 if the index block can not be read
+static int index_lower_bound(ArchiveIndex *index, const char *file_path, uint32_t *block, uint32_t *entry)
+{
+    // Paths before the first block start at its first entry
+    *block = 0;
+    *entry = 0;
+    if (index->block_count == 0)
+    {
+        return 0;
+    }
+    if (!find_index_block(index, file_path, block))
+    {
+        return load_index_block(index, 0);
+    }
+    if (load_index_block(index, *block) != 0)
+    {
+        return 1;
+    }
+
+    // The entries of a block are sorted as well
+    uint32_t low = 0;
+    uint32_t high = index->blocks[*block].entry_count;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (compare_index_path(index->entries[middle].path, file_path) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    *entry = low;
+
+    // All entries of the block come before the path, the next block starts after it
+    if (low == index->blocks[*block].entry_count)
+    {
+        (*block)++;
+        *entry = 0;
+    }
+    return 0;
+}
+
+
+// Find the entry of a file path in the index, loading only the index block it belongs in. Returns 1 and the entry
+// (valid until another block is loaded) if found, 0 if not, and -1 if the index can not be read
+static int find_index_entry(ArchiveIndex *index, const char *file_path, IndexEntry **entry)
+{
+    uint32_t block;
+    uint32_t position;
+    if (index_lower_bound(index, file_path, &block, &position) != 0)
+    {
+        return -1;
+    }
+    if (block == index->block_count)
+    {
+        return 0;
+    }
+    if (load_index_block(index, block) != 0)
+    {
+        return -1;
+    }
+    if (strcmp(index->entries[position].path, file_path) != 0)
+    {
+        return 0;
+    }
+    *entry = &index->entries[position];
+    return 1;
+}
+
+
+// Read the next entry header, its file path, the original file size as it was when the file was read and the
+// entry flags (flags can be NULL). Returns 1 for an entry, 0 when the index after the last entry is reached and
+// -1 on errors
+static int read_entry_header(ArchiveStream *in, char *file_path, uint64_t *original_size, uint16_t *flags)
+{
+    unsigned char header[ENTRY_HEADER_SIZE];
+    if (read_bytes(in, header, 4) != 0)
+    {
+        return -1;
+    }
+    uint32_t signature = get_u32(header);
+    if (signature == INDEX_SIGNATURE)
+    {
+        return 0;
+    }
+    if (signature != ENTRY_SIGNATURE)
+    {
+        fprintf(stderr, "Error: corrupt archive (invalid entry header)\n");
+        return -1;
+    }
+
+    if (read_bytes(in, header + 4, ENTRY_HEADER_SIZE - 4) != 0)
+    {
+        return -1;
+    }
+    size_t path_len = get_u16(header + 4);
+    if (path_len == 0 || path_len > MAX_PATH_LEN)
+    {
+        fprintf(stderr, "Error: corrupt archive (invalid file path length)\n");
+        return -1;
+    }
+    *original_size = get_u64(header + 8);
+    if (flags)
+    {
+        *flags = get_u16(header + 6);
+    }
+    if (read_bytes(in, file_path, path_len) != 0)
+    {
+        return -1;
+    }
+    file_path[path_len] = '\0';
+    if (strlen(file_path) != path_len)
+    {
+        fprintf(stderr, "Error: corrupt archive (invalid file path)\n");
+        return -1;
+    }
+    return 1;
+}
+
+
+static int write_bytes(ArchiveStream *out, const void *data, size_t len)
+{
+    uint64_t start = mdarc_stats_clock();
+    if (fwrite(data, 1, len, out->file) != len)
+    {
+        perror("Error writing archive");
+        return 1;
+    }
+    mdarc_stats_add(STAT_WRITE_ARCHIVE, start, 1, len);
+    out->offset += len;
+    return 0;
+}
+
+
+static int read_bytes(ArchiveStream *in, void *data, size_t len)
+{
+    uint64_t start = mdarc_stats_clock();
+    size_t read_len = fread(data, 1, len, in->file);
+    mdarc_stats_add(STAT_READ_ARCHIVE, start, 1, read_len);
+    if (read_len != len)
+    {
+        if (ferror(in->file))
+        {
+            perror("Error reading archive");
+        }
+        else
+        {
+            fprintf(stderr, "Error: unexpected end of archive\n");
+        }
+        return 1;
+    }
+    in->offset += len;
+    return 0;
+}
+
+
+// Skip over archive data, by seeking when possible and by reading through it on pipes
+static int skip_bytes(ArchiveStream *in, uint64_t len)
+{
+    if (in->seekable)
+    {
+        if (fseeko(in->file, len, SEEK_CUR) != 0)
+        {
+            perror("Error reading archive");
+            return 1;
+        }
+        in->offset += len;
+        return 0;
+    }
+
+    unsigned char buffer[8192];
+    while (len > 0)
+    {
+        size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+        if (read_bytes(in, buffer, chunk) != 0)
+        {
+            return 1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+
+// Close an archive file, the standard streams are only flushed
+static int close_archive(FILE *archive)
+{
+    if (archive == stdin)
+    {
+        return 0;
+    }
+    if (archive == stdout)
+    {
+        return fflush(stdout);
+    }
+    return fclose(archive);
+}
+
+
+// Monotonic clock in nanoseconds for --stats, --trace and --progress. Returns 0 without reading the clock when
+// they are all off, so the timed code costs only a branch then
+uint64_t mdarc_stats_clock(void)
+{
+    if (!mdarc_stats_enabled && !mdarc_trace_enabled && !mdarc_progress_enabled)
+    {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+// Add the time since start, a number of calls (files, blocks, ...) and bytes to a phase. With --trace the time
+// is also recorded as a span of the phase on the timeline of the calling thread
+void mdarc_stats_add(StatPhase phase, uint64_t start, uint64_t calls, uint64_t bytes)
+{
+    if (!mdarc_stats_enabled && !mdarc_trace_enabled)
+    {
+        return;
+    }
+    uint64_t end = mdarc_stats_clock();
+    mdarc_trace_span(phase_names[phase], start, end);
+    if (!mdarc_stats_enabled)
+    {
+        return;
+    }
+    __atomic_fetch_add(&phase_stats[phase].ns, end - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phase_stats[phase].calls, calls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phase_stats[phase].bytes, bytes, __ATOMIC_RELAXED);
+}
+
+
+// Print the --stats table to stderr, so it does not mix with an archive written to stdout
+void mdarc_print_stats(uint64_t start)
+{
+    double wall = (mdarc_stats_clock() - start) / 1e9;
+    fprintf(stderr, "%-14s %10s %10s %12s %10s\n", "Phase", "Time (s)", "Calls", "MB", "MB/s");
+    for (int i = 0; i < STAT_PHASES; i++)
+    {
+        if (phase_stats[i].calls == 0)
+        {
+            continue;
+        }
+        double seconds = phase_stats[i].ns / 1e9;
+        double megabytes = phase_stats[i].bytes / (1024.0 * 1024.0);
+        fprintf(stderr, "%-14s %10.3f %10" PRIu64, phase_names[i], seconds, phase_stats[i].calls);
+        if (phase_stats[i].bytes > 0)
+        {
+            fprintf(stderr, " %12.1f %10.1f\n", megabytes, seconds > 0 ? megabytes / seconds : 0.0);
+        }
+        else
+        {
+            fprintf(stderr, " %12s %10s\n", "-", "-");
+        }
+    }
+    fprintf(stderr, "Wall time %.3f s. Phase times are summed over all threads and can add up to more\n", wall);
+}
+
+
+// Thread exit destructor of trace_key: frees the ring of the thread for the next new thread, which keeps adding to it
+static void trace_release_buffer(void *buffer)
+{
+    pthread_mutex_lock(&trace_lock);
+    ((TraceBuffer *)buffer)->in_use = false;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+
+static void trace_create_key(void)
+{
+    trace_key_created = pthread_key_create(&trace_key, trace_release_buffer) == 0;
+}
+
+
+// Event ring of the calling thread, taken on its first event from a thread that has exited, or set up and added to
+// trace_buffers while there are less than TRACE_MAX_THREADS. NULL if there is no memory for it or all rings are held
+// by running threads, the events of the thread are then left out of the trace
+static TraceBuffer *trace_get_buffer(void)
+{
+    if (trace_buffer || trace_no_buffer)
+    {
+        return trace_buffer;
+    }
+    pthread_once(&trace_key_once, trace_create_key);
+
+    pthread_mutex_lock(&trace_lock);
+    TraceBuffer *buffer = trace_buffers;
+    while (buffer && buffer->in_use)
+    {
+        buffer = buffer->next;
+    }
+    bool limit_reached = false;
+    bool alloc_failed = false;
+    if (buffer)
+    {
+        buffer->label[0] = '\0';
+    }
+    else if (trace_thread_count >= TRACE_MAX_THREADS)
+    {
+        // Report it once, not for every thread
+        limit_reached = !trace_limit_reached;
+        trace_limit_reached = true;
+    }
+    else
+    {
+        buffer = calloc(1, sizeof(TraceBuffer));
+        if (buffer && !(buffer->events = malloc(TRACE_RING_SIZE * sizeof(TraceEvent))))
+        {
+            free(buffer);
+            buffer = NULL;
+        }
+        if (buffer)
+        {
+            buffer->tid = ++trace_thread_count;
+            buffer->next = trace_buffers;
+            trace_buffers = buffer;
+        }
+        else
+        {
+            // Report it once, not for every thread
+            alloc_failed = !trace_alloc_failed;
+            trace_alloc_failed = true;
+        }
+    }
+    if (buffer)
+    {
+        buffer->in_use = true;
+        snprintf(buffer->name, sizeof(buffer->name), "thread %u", buffer->tid);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if (alloc_failed)
+    {
+        fprintf(stderr, "Error allocating memory for trace events\n");
+    }
+    if (limit_reached)
+    {
+        fprintf(stderr, "Warning: --trace records at most %d threads at a time, the spans of further threads are "
+                "left out\n", TRACE_MAX_THREADS);
+    }
+    if (buffer && trace_key_created)
+    {
+        pthread_setspecific(trace_key, buffer);
+    }
+    trace_buffer = buffer;
+    trace_no_buffer = !buffer;
+    return buffer;
+}
+
+
+// Name the timeline of the calling thread in the trace
+void mdarc_trace_thread(const char *name)
+{
+    TraceBuffer *buffer = mdarc_trace_enabled ? trace_get_buffer() : NULL;
+    if (buffer)
+    {
+        snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+    }
+}
+
+
+// Set the entry the calling thread works on, its following spans are labelled with it. Long paths are cut at the
+// front, the end of a path tells more about the file
+static void trace_label(const char *label)
+{
+    TraceBuffer *buffer = mdarc_trace_enabled ? trace_get_buffer() : NULL;
+    if (!buffer)
+    {
+        return;
+    }
+    size_t len = strlen(label);
+    if (len < TRACE_LABEL_LEN)
+    {
+        memcpy(buffer->label, label, len + 1);
+    }
+    else
+    {
+        snprintf(buffer->label, TRACE_LABEL_LEN, "...%s", label + len - (TRACE_LABEL_LEN - 4));
+    }
+}
+
+
+// Record a span of the calling thread. When its ring is full the oldest span is overwritten
+void mdarc_trace_span(const char *name, uint64_t start, uint64_t end)
+{
+    TraceBuffer *buffer = mdarc_trace_enabled ? trace_get_buffer() : NULL;
+    if (!buffer)
+    {
+        return;
+    }
+    TraceEvent *event = &buffer->events[buffer->count++ % TRACE_RING_SIZE];
+    event->start = start;
+    event->end = end;
+    event->name = name;
+    memcpy(event->label, buffer->label, TRACE_LABEL_LEN);
+}
+
+
+// Write the recorded spans in the Chrome trace event format, which Perfetto and chrome://tracing load, and free
+// the rings. Every thread is a track of complete ("X") events, times are in microseconds since start. Must only
+// be called once all other threads are joined
+int mdarc_write_trace(const char *path, uint64_t start)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        perror("Error creating trace file");
+    }
+
+    uint64_t dropped = 0;
+    bool first = true;
+    if (out)
+    {
+        fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    }
+    while (trace_buffers)
+    {
+        TraceBuffer *buffer = trace_buffers;
+        trace_buffers = buffer->next;
+        uint64_t first_event = buffer->count > TRACE_RING_SIZE ? buffer->count - TRACE_RING_SIZE : 0;
+        dropped += first_event;
+        if (out)
+        {
+            fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                    first ? "" : ",\n", buffer->tid);
+            write_json_string(out, buffer->name);
+            fprintf(out, "}}");
+            first = false;
+        }
+        for (uint64_t i = first_event; out && i < buffer->count; i++)
+        {
+            TraceEvent *event = &buffer->events[i % TRACE_RING_SIZE];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                    event->name, buffer->tid, (event->start - start) / 1e3, (event->end - event->start) / 1e3);
+            if (event->label[0] != '\0')
+            {
+                fprintf(out, ",\"args\":{\"entry\":");
+                write_json_string(out, event->label);
+                fprintf(out, "}");
+            }
+            fprintf(out, "}");
+        }
+        free(buffer->events);
+        free(buffer);
+    }
+    if (!out)
+    {
+        return 1;
+    }
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0)
+    {
+        perror("Error writing trace file");
+        return 1;
+    }
+    if (dropped > 0)
+    {
+        fprintf(stderr, "Warning: trace is missing the oldest %" PRIu64 " spans, the event rings were full\n",
+                dropped);
+    }
+    return 0;
+}
+
+
+// Count files written to the archive and bytes of file data read, for --progress
+static void progress_add(uint64_t files, uint64_t bytes)
+{
+    if (!mdarc_progress_enabled)
+    {
+        return;
+    }
+    __atomic_fetch_add(&progress_files, files, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&progress_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+
+// Start the --progress reporter thread
+static int progress_start(ProgressReporter *reporter, Options *opts)
+{
+    *reporter = (ProgressReporter) { .opts = opts, .start = mdarc_stats_clock() };
+    pthread_mutex_init(&reporter->lock, NULL);
+    pthread_cond_init(&reporter->changed, NULL);
+    if (pthread_create(&reporter->thread, NULL, progress_reporter, reporter) != 0)
+    {
+        perror("Error starting progress reporter");
+        pthread_mutex_destroy(&reporter->lock);
+        pthread_cond_destroy(&reporter->changed);
+        return 1;
+    }
+    return 0;
+}
+
+
+// Stop the reporter, which prints the final totals
+static void progress_stop(ProgressReporter *reporter)
+{
+    pthread_mutex_lock(&reporter->lock);
+    reporter->done = true;
+    pthread_cond_signal(&reporter->changed);
+    pthread_mutex_unlock(&reporter->lock);
+    pthread_join(reporter->thread, NULL);
+    pthread_mutex_destroy(&reporter->lock);
+    pthread_cond_destroy(&reporter->changed);
+}
+
+
+// Progress reporter thread. Wakes up every opts->progress seconds, or when archiving is done, and prints the
+// counters. The throughput is smoothed over the last intervals, so the ETA does not jump with every file
+static void *progress_reporter(void *arg)
+{
+    ProgressReporter *reporter = arg;
+    uint64_t last_time = reporter->start;
+    uint64_t last_bytes = 0;
+    double rate = -1; // Bytes per second, none before the first interval
+    bool done = false;
+    pthread_mutex_lock(&reporter->lock);
+    while (!done)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += reporter->opts->progress;
+        int wait = 0;
+        while (!reporter->done && wait != ETIMEDOUT)
+        {
+            wait = pthread_cond_timedwait(&reporter->changed, &reporter->lock, &deadline);
+        }
+        done = reporter->done;
+        pthread_mutex_unlock(&reporter->lock);
+
+        uint64_t now = mdarc_stats_clock();
+        uint64_t bytes = __atomic_load_n(&progress_bytes, __ATOMIC_RELAXED);
+        if (now > last_time)
+        {
+            double current = (bytes - last_bytes) * 1e9 / (now - last_time);
+            rate = rate < 0 ? current : PROGRESS_SMOOTHING * current + (1 - PROGRESS_SMOOTHING) * rate;
+        }
+        last_time = now;
+        last_bytes = bytes;
+        print_progress(reporter, rate, done);
+        pthread_mutex_lock(&reporter->lock);
+    }
+    pthread_mutex_unlock(&reporter->lock);
+    return NULL;
+}
+
+
+// Print one progress line to stderr. On a terminal the line is updated in place, otherwise (a log file) every
+// update is a line of its own. The last line shows the totals and the average throughput
+static void print_progress(ProgressReporter *reporter, double rate, bool last)
+{
+    Options *opts = reporter->opts;
+    pthread_mutex_lock(&opts->list_lock);
+    uint64_t total_bytes = opts->total_bytes;
+    unsigned int total_files = opts->file_count;
+    bool complete = opts->list_complete; // With -T the total grows until the list is read
+    pthread_mutex_unlock(&opts->list_lock);
+    uint64_t bytes = __atomic_load_n(&progress_bytes, __ATOMIC_RELAXED);
+    uint64_t files = __atomic_load_n(&progress_files, __ATOMIC_RELAXED);
+    double elapsed = (mdarc_stats_clock() - reporter->start) / 1e9;
+    double megabytes = 1024.0 * 1024.0;
+
+    bool terminal = isatty(STDERR_FILENO);
+    fprintf(stderr, "%s%.1f of %.1f%s MB", terminal ? "\r" : "", bytes / megabytes, total_bytes / megabytes,
+            complete ? "" : "+");
+    if (total_bytes > 0)
+    {
+        fprintf(stderr, " (%.0f%%)", bytes < total_bytes ? 100.0 * bytes / total_bytes : 100.0);
+    }
+    fprintf(stderr, ", %" PRIu64 " of %u%s files", files, total_files, complete ? "" : "+");
+    if (last)
+    {
+        fprintf(stderr, ", %.1f MB/s, done in %.0f s%s\n", elapsed > 0 ? bytes / megabytes / elapsed : 0.0, elapsed,
+                terminal ? "\033[K" : "");
+        return;
+    }
+    fprintf(stderr, ", %.1f MB/s", rate > 0 ? rate / megabytes : 0.0);
+    if (rate > 0 && complete)
+    {
+        uint64_t eta = total_bytes > bytes ? (total_bytes - bytes) / rate : 0;
+        fprintf(stderr, ", ETA %" PRIu64 ":%02" PRIu64 ":%02" PRIu64, eta / 3600, eta / 60 % 60, eta % 60);
+    }
+    fprintf(stderr, "%s", terminal ? "\033[K" : "\n");
+}
+
+
+// Write text as a JSON string, with quotes, backslashes and control characters escaped
+static void write_json_string(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *) text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fprintf(out, "\\%c", *c);
+        }
+        else if (*c < 0x20)
+        {
+            fprintf(out, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+
+// CRC32C (Castagnoli) of data, continuing from a previous crc (0 to start). Uses the SSE4.2 crc32 instruction
+// when the CPU has it and a table driven implementation otherwise
+static uint32_t crc32c(uint32_t crc, const unsigned char *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+#if HAVE_CRC32C_SSE42
+    if (crc32c_use_sse42)
+    {
+        return crc32c_sse42(crc, data, len);
+    }
+#endif
+    return crc32c_sw(crc, data, len);
+}
+
+
+static void crc32c_init(void)
+{
+    // Lookup tables for processing 8 bytes at a time
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++)
+        {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+    crc32c_zeros(crc32c_block, DATA_BLOCK_SIZE);
+
+#if HAVE_CRC32C_SSE42
+    crc32c_use_sse42 = __builtin_cpu_supports("sse4.2");
+    if (crc32c_use_sse42)
+    {
+        crc32c_zeros(crc32c_long, CRC32C_LONG);
+        crc32c_zeros(crc32c_short, CRC32C_SHORT);
+    }
+#endif
+}
+
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *data, size_t len)
+{
+    uint64_t value = crc ^ 0xffffffff;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        value ^= word;
+        value = crc32c_table[7][value & 0xff] ^ crc32c_table[6][(value >> 8) & 0xff] ^
+                crc32c_table[5][(value >> 16) & 0xff] ^ crc32c_table[4][(value >> 24) & 0xff] ^
+                crc32c_table[3][(value >> 32) & 0xff] ^ crc32c_table[2][(value >> 40) & 0xff] ^
+                crc32c_table[1][(value >> 48) & 0xff] ^ crc32c_table[0][value >> 56];
+        data += 8;
+        len -= 8;
+    }
+#endif
+    while (len > 0)
+    {
+        value = crc32c_table[0][(value ^ *data++) & 0xff] ^ (value >> 8);
+        len--;
+    }
+    return (uint32_t) value ^ 0xffffffff;
+}
+
+
+#if HAVE_CRC32C_SSE42
+// The crc32 instruction has a latency of 3 cycles but can start every cycle, so long buffers are processed as
+// three interleaved streams whose CRCs are then combined by shifting them over the length of the following streams
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len)
+{
+    uint64_t crc0 = crc ^ 0xffffffff;
+
+    while (len >= 3 * CRC32C_LONG)
+    {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char *end = data + CRC32C_LONG;
+        do
+        {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, data, 8);
+            memcpy(&word1, data + CRC32C_LONG, 8);
+            memcpy(&word2, data + 2 * CRC32C_LONG, 8);
+            crc0 = _mm_crc32_u64(crc0, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+            data += 8;
+        } while (data < end);
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+        data += 2 * CRC32C_LONG;
+        len -= 3 * CRC32C_LONG;
+    }
+
+    while (len >= 3 * CRC32C_SHORT)
+    {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char *end = data + CRC32C_SHORT;
+        do
+        {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, data, 8);
+            memcpy(&word1, data + CRC32C_SHORT, 8);
+            memcpy(&word2, data + 2 * CRC32C_SHORT, 8);
+            crc0 = _mm_crc32_u64(crc0, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+            data += 8;
+        } while (data < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        data += 2 * CRC32C_SHORT;
+        len -= 3 * CRC32C_SHORT;
+    }
+
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0)
+    {
+        crc0 = _mm_crc32_u8(crc0, *data++);
+        len--;
+    }
+    return (uint32_t) crc0 ^ 0xffffffff;
+}
+#endif
+
+
+// CRC32C of two buffers one after the other, from the CRC32C of each and the length of the second. Used to join
+// the checksums of data blocks decoded out of order
+static uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    // Full data blocks have a precomputed table, other lengths build the zeros operator bit by bit
+    if (len2 == DATA_BLOCK_SIZE)
+    {
+        return crc32c_shift(crc32c_block, crc1) ^ crc2;
+    }
+    if (len2 == 0)
+    {
+        return crc1;
+    }
+    uint32_t even[32];
+    uint32_t odd[32];
+    odd[0] = CRC32C_POLY; // One zero bit operator
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); // 2 zero bits
+    gf2_matrix_square(odd, even); // 4 zero bits
+
+    // Apply the operators of 1, 2, 4, ... zero bytes for each set bit of len2
+    do
+    {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1)
+        {
+            crc1 = gf2_matrix_times(even, crc1);
+        }
+        len2 >>= 1;
+        if (len2 == 0)
+        {
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        if (len2 & 1)
+        {
+            crc1 = gf2_matrix_times(odd, crc1);
+        }
+        len2 >>= 1;
+    } while (len2);
+    return crc1 ^ crc2;
+}
+
+
+// CRC32C of data followed by len zero bytes, from the CRC32C of the data. Used for the holes of sparse files
+static uint32_t crc32c_append_zeros(uint32_t crc, uint64_t len)
+{
+    // The zero bytes alone have the CRC32C of the all ones register shifted over them
+    return crc32c_combine(crc ^ 0xffffffff, 0xffffffff, len);
+}
+
+
+// Apply the zeros operator table of crc32c_zeros() to a crc
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+
+// Build tables that advance a crc over len zero bytes (len a power of 2), byte by byte of the crc
+static void crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+    uint32_t op[32];
+    crc32c_zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+
+// Construct the GF(2) matrix that applies len zero bytes to a crc, by repeated squaring of the one zero bit operator
+static void crc32c_zeros_op(uint32_t *even, size_t len)
+{
+    uint32_t odd[32];
+    odd[0] = CRC32C_POLY;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2_matrix_square(even, odd); // 2 zero bits
+    gf2_matrix_square(odd, even); // 4 zero bits
+    // Each square doubles the number of zeros, starting at 8 bits = 1 byte
+    do
+    {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+        {
+            return;
+        }
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+    memcpy(even, odd, sizeof(odd));
+}
+
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    while (vec)
+    {
+        if (vec & 1)
+        {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+    {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+
+// Numbers in the archive are stored little endian, independent of the host byte order
+static void put_u16(unsigned char *buf, uint16_t value)
+{
+    buf[0] = value & 0xff;
+    buf[1] = value >> 8;
+}
+
+
+static void put_u32(unsigned char *buf, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        buf[i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+
+static void put_u64(unsigned char *buf, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        buf[i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+
+static uint16_t get_u16(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+
+static uint32_t get_u32(const unsigned char *buf)
+{
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--)
+    {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+
+static uint64_t get_u64(const unsigned char *buf)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+
+// Function to expand wildcard patterns
+int mdarc_expand_wildcards_and_add(const char *pattern, Options *opts)
+{
+    struct stat path_stat;
+    if (stat(pattern, &path_stat) == 0 && S_ISDIR(path_stat.st_mode))
+    {
+        // The pattern is a directory, traverse it. Files that can not be read are skipped, the archive is still
+        // written but fails at the end
+        if (traverse_directory(pattern, opts) != 0)
+        {
+            opts->list_failed = true;
+        }
+        return 0;
+    }
+
+    // Handle file patterns (if not a directory)
+    glob_t results;
+    int ret = glob(pattern, 0, NULL, &results);
+
+    if (ret != 0)
+    {
+        if (ret == GLOB_NOMATCH)
+        {
+            fprintf(stderr, "No match for the pattern: %s\n", pattern);
+        }
+        else
+        {
+            perror("Error processing glob pattern");
+            return 1;
+        }
+    }
+
+    // Add matched files to the list
+    for (size_t i = 0; i < results.gl_pathc; i ++)
+    {
+        if (is_filtered_out(opts, results.gl_pathv[i], false))
+        {
+            continue;
+        }
+        // Only --progress needs the size, glob() does not stat the files it finds
+        struct stat file_stat;
+        uint64_t size = 0;
+        if (opts->progress > 0 && stat(results.gl_pathv[i], &file_stat) == 0)
+        {
+            size = file_stat.st_size;
+        }
+        if (add_file_to_list(opts, results.gl_pathv[i], size, NULL) != 0)
+        {
+            globfree(&results); // Clean up
+            return 1;
+        };
+    }
+
+    globfree(&results); // Clean up
+    return 0;
+}
+
+
+// Add a path read from the -T manifest. Paths are taken literally, without wildcard expansion
+static int add_path_to_list(const char *path, Options *opts)
+{
+    struct stat path_stat;
+    if (stat(path, &path_stat) != 0)
+    {
+        fprintf(stderr, "Error retrieving file information for %s: %s\n", path, strerror(errno));
+        return 0; // Skip the entry, same as an unmatched pattern
+    }
+
+    if (S_ISDIR(path_stat.st_mode))
+    {
+        return traverse_directory(path, opts);
+    }
+    else if (!is_filtered_out(opts, path, false))
+    {
+        return add_file_to_list(opts, (char *) path, path_stat.st_size, NULL);
+    }
+    return 0;
+}
+
+
+// File list reader thread for -T. Streams paths from the manifest into the file list, so the compression
+// workers can start on the first entries while the rest of the manifest is still being read
+static void *read_list_file(void *arg)
+{
+    Options *opts = arg;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int delim = opts->null_separated ? '\0' : '\n';
+    mdarc_trace_thread("file list reader");
+
+    while ((len = getdelim(&line, &line_size, delim, opts->list_stream)) != -1)
+    {
+        // Strip the delimiter and skip empty entries
+        if (len > 0 && line[len - 1] == delim)
+        {
+            line[--len] = '\0';
+        }
+        if (len == 0)
+        {
+            continue;
+        }
+
+        uint64_t start = mdarc_stats_clock();
+        trace_label(line);
+        unsigned int listed = opts->file_count; // Only this thread adds to the list now
+        int ret = add_path_to_list(line, opts);
+        mdarc_stats_add(STAT_WALK, start, opts->file_count - listed, 0);
+        if (ret != 0)
+        {
+            opts->list_failed = true; // Keep going, the other paths are still archived
+        }
+    }
+    if (ferror(opts->list_stream))
+    {
+        perror("Error reading file list");
+        opts->list_failed = true;
+    }
+    free(line);
+
+    if (opts->list_stream != stdin)
+    {
+        fclose(opts->list_stream);
+    }
+    opts->list_stream = NULL;
+
+    // Let the workers and the archive writer know no more entries are coming
+    pthread_mutex_lock(&opts->list_lock);
+    opts->list_complete = true;
+    pthread_cond_broadcast(&opts->list_changed);
+    pthread_mutex_unlock(&opts->list_lock);
+    return NULL;
+}
+
+
+// Function to add file name with path into the linked list. size is only counted for --progress. data is NULL
+// for files, or the malloc'ed contents of an entry added from memory, which the list takes over if 0 is returned
+static int add_file_to_list(Options *opts, char *file_path, uint64_t size, unsigned char *data)
+{
+    // Allocate memory for the new node
+    FileNode *new_file = malloc(sizeof(FileNode));
+    if (new_file == NULL)
+    {
+        perror("Could not allocate memory for file node");
+        return 1;
+    }
+
+    // The path stored in the archive has to be one that unarchive extracts below the current directory
+    bool stripped = false;
+    char *archive_path = make_archive_path(file_path, &stripped);
+    if (archive_path == NULL)
+    {
+        perror("Could not allocate memory for file name");
+        free(new_file);
+        return 1;
+    }
+    if (!is_safe_path(archive_path))
+    {
+        fprintf(stderr, "Error: unsafe file path, skipping %s\n", file_path);
+        free(archive_path);
+        free(new_file);
+        return 1;
+    }
+
+    // Copy full path. The archive path is mostly its end, otherwise it is kept behind it in the same allocation
+    size_t len = strlen(file_path);
+    size_t archive_len = strlen(archive_path);
+    bool is_suffix = strcmp(file_path + len - archive_len, archive_path) == 0;
+    new_file->file_name = malloc(is_suffix ? len + 1 : len + archive_len + 2);
+    if (new_file->file_name == NULL)
+    {
+        perror("Could not allocate memory for file name");
+        free(archive_path);
+        free(new_file);
+        return 1;
+    }
+    memcpy(new_file->file_name, file_path, len + 1);
+    new_file->archive_path = new_file->file_name + len - archive_len;
+    if (!is_suffix)
+    {
+        memcpy(new_file->file_name + len + 1, archive_path, archive_len + 1);
+        new_file->archive_path = new_file->file_name + len + 1;
+    }
+    free(archive_path);
+
+    new_file->next = NULL;
+    new_file->list_index = 0;
+    new_file->status = ENTRY_PENDING;
+    new_file->payload = NULL;
+    new_file->payload_pooled = false;
+    new_file->payload_size = 0;
+    new_file->payload_capacity = 0;
+    new_file->original_size = 0;
+    new_file->compressed_size = 0;
+    new_file->checksum = 0;
+    new_file->sparse = false;
+    new_file->stream = false;
+    new_file->header_offset = 0;
+    new_file->read_ahead = data ? READ_AHEAD_DATA : READ_AHEAD_PENDING;
+    new_file->read_data = data;
+    new_file->read_len = data ? size : 0;
+    new_file->read_pooled = false;
+
+    // The list may be consumed by the compression workers at the same time
+    pthread_mutex_lock(&opts->list_lock);
+    if (opts->file_list == NULL) // If first element in file list
+    {
+        opts->file_list = new_file;
+    }
+    else
+    {
+        opts->file_list_tail->next = new_file; // Append to the end of the list
+    }
+    opts->file_list_tail = new_file;
+
+    new_file->list_index = opts->file_count;
+    opts->file_count++; // Increment file count
+    opts->total_bytes += size;
+    bool warn = stripped && !opts->paths_stripped; // Like tar, only the first stripped path is reported
+    opts->paths_stripped |= stripped;
+    pthread_cond_broadcast(&opts->list_changed);
+    pthread_mutex_unlock(&opts->list_lock);
+
+    if (warn)
+    {
+        fprintf(stderr, "Warning: removing leading '/' and '..' from paths in the archive, %s is stored as %s\n",
+                new_file->file_name, new_file->archive_path);
+    }
+    return 0;
+}
+
+
+// Path of a file as it is stored in the archive, always below the directory it is extracted to. Empty and "."
+// components are dropped. Like tar, a leading '/' and everything up to the last ".." component are removed, which
+// sets *stripped. Returns a malloc'ed string, empty if no name is left, or NULL if out of memory
+static char *make_archive_path(const char *file_path, bool *stripped)
+{
+    char *path = malloc(strlen(file_path) + 1);
+    if (!path)
+    {
+        return NULL;
+    }
+    *stripped = file_path[0] == '/';
+    size_t len = 0;
+    const char *component = file_path;
+    while (*component != '\0')
+    {
+        const char *end = strchr(component, '/');
+        size_t component_len = end ? (size_t) (end - component) : strlen(component);
+        if (component_len == 2 && component[0] == '.' && component[1] == '.')
+        {
+            len = 0;
+            *stripped = true;
+        }
+        else if (component_len > 0 && !(component_len == 1 && component[0] == '.'))
+        {
+            if (len > 0)
+            {
+                path[len++] = '/';
+            }
+            memcpy(path + len, component, component_len);
+            len += component_len;
+        }
+        component += component_len + (end != NULL);
+    }
+    path[len] = '\0';
+    return path;
+}
+
+
+// Add the files of dir_path, and with -r of all directories below it. Entries that can not be read or added are
+// reported and skipped. Returns 1 if anything was left out
+static int traverse_directory(const char *dir_path, Options *opts)
+{
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+    {
+        fprintf(stderr, "Error opening directory %s: %s\n", dir_path, strerror(errno));
+        return 1;
+    }
+
+    int ret = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        // Skip special cases for directories "." and ".."
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        // Construct full path
+        size_t path_len = strlen(dir_path);
+        size_t entry_len = strlen(entry->d_name);
+        size_t full_path_len = path_len + entry_len + 2; // +1 for '/' and +1 for '\0'
+        char *full_path = malloc(full_path_len);
+        if (!full_path)
+        {
+            perror("Error allocating memory for path");
+            ret = 1;
+            break;
+        }
+
+        snprintf(full_path, full_path_len, "%s%s%s", dir_path, (dir_path[path_len - 1] == '/' ? "" : "/"), entry->d_name);
+
+        // Use stat() to determine file type
+        struct stat path_stat;
+        if (stat(full_path, &path_stat) != 0)
+        {
+            fprintf(stderr, "Error retrieving file information for %s: %s\n", full_path, strerror(errno));
+            ret = 1;
+        }
+        // Excluded directories are pruned here, without reading any of their contents
+        else if (!is_filtered_out(opts, full_path, S_ISDIR(path_stat.st_mode)))
+        {
+            if (S_ISDIR(path_stat.st_mode)) // If a directory
+            {
+                if (opts->r && traverse_directory(full_path, opts) != 0) // Recurse only if -r specified
+                {
+                    ret = 1;
+                }
+            }
+            else if (S_ISREG(path_stat.st_mode)) // If a regular file
+            {
+                if (add_file_to_list(opts, full_path, path_stat.st_size, NULL) != 0)
+                {
+                    ret = 1;
+                }
+            }
+        }
+        free(full_path);
+    }
+    closedir(dir);
+    return ret;
+}
+
+
+// Reorder the file list by physical location, so that reading the files on spinning disks and cold cloud volumes
+// mostly moves forward instead of seeking back and forth. list_index keeps the original order for equal locations
+static int sort_by_location(Options *opts)
+{
+    if (opts->file_count < 2)
+    {
+        return 0;
+    }
+
+    FileLocation *locations = malloc(opts->file_count * sizeof(FileLocation));
+    if (!locations)
+    {
+        perror("Error allocating memory for sorting files, keeping list order");
+        return 1;
+    }
+
+    size_t count = 0;
+    for (FileNode *node = opts->file_list; node != NULL; node = node->next)
+    {
+        locations[count].node = node;
+        get_file_location(&locations[count], opts->read_order == READ_ORDER_EXTENT);
+        count++;
+    }
+    qsort(locations, count, sizeof(FileLocation), compare_locations);
+
+    // Relink the list in sorted order
+    for (size_t i = 0; i + 1 < count; i++)
+    {
+        locations[i].node->next = locations[i + 1].node;
+    }
+    locations[count - 1].node->next = NULL;
+    opts->file_list = locations[0].node;
+    opts->file_list_tail = locations[count - 1].node;
+
+    free(locations);
+    return 0;
+}
+
+
+// Find the device and inode of a file and, if requested and supported by the file system, the position of its
+// first extent on disk. Files that can not be stat'ed are sorted to the end and reported when they are read
+static void get_file_location(FileLocation *location, bool use_extent)
+{
+    struct stat path_stat;
+    location->has_extent = false;
+    if (stat(location->node->file_name, &path_stat) != 0)
+    {
+        location->device = (dev_t) -1;
+        location->key = UINT64_MAX;
+        return;
+    }
+    location->device = path_stat.st_dev;
+    location->key = path_stat.st_ino;
+
+#if HAVE_FIEMAP
+    if (!use_extent)
+    {
+        return;
+    }
+    int fd = open(location->node->file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    // Ask for the first extent only
+    union
+    {
+        struct fiemap map;
+        char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 && request.map.fm_mapped_extents > 0 &&
+        !(request.map.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+    {
+        location->has_extent = true;
+        location->key = request.map.fm_extents[0].fe_physical;
+    }
+    close(fd);
+#else
+    (void) use_extent;
+#endif
+}
+
+
+// Sort by device, then files with a known extent by disk position, then the rest by inode number
+static int compare_locations(const void *a, const void *b)
+{
+    const FileLocation *la = a;
+    const FileLocation *lb = b;
+    if (la->device != lb->device)
+    {
+        return la->device < lb->device ? -1 : 1;
+    }
+    if (la->has_extent != lb->has_extent)
+    {
+        return la->has_extent ? -1 : 1;
+    }
+    if (la->key != lb->key)
+    {
+        return la->key < lb->key ? -1 : 1;
+    }
+    return la->node->list_index < lb->node->list_index ? -1 : 1;
+}
+
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t ua = *(const uint64_t *) a;
+    uint64_t ub = *(const uint64_t *) b;
+    if (ua != ub)
+    {
+        return ua < ub ? -1 : 1;
+    }
+    return 0;
+}
+
+
+static int compare_list_index(const void *a, const void *b)
+{
+    const IndexEntry *ea = a;
+    const IndexEntry *eb = b;
+    if (ea->list_index != eb->list_index)
+    {
+        return ea->list_index < eb->list_index ? -1 : 1;
+    }
+    return 0;
+}
+
+
+// Order of the paths in the index: by directory, then by file name. Directories are compared with '/' before every
+// other character, so a directory comes right before its subdirectories and everything below a directory is one
+// contiguous range of the index
+static int compare_index_path(const char *a, const char *b)
+{
+    const char *a_name = strrchr(a, '/');
+    const char *b_name = strrchr(b, '/');
+    size_t a_dir = a_name ? (size_t) (a_name - a) + 1 : 0; // Directory length with its trailing '/'
+    size_t b_dir = b_name ? (size_t) (b_name - b) + 1 : 0;
+    for (size_t i = 0; i < a_dir && i < b_dir; i++)
+    {
+        int ca = a[i] == '/' ? 0 : (unsigned char) a[i];
+        int cb = b[i] == '/' ? 0 : (unsigned char) b[i];
+        if (ca != cb)
+        {
+            return ca - cb;
+        }
+    }
+    if (a_dir != b_dir)
+    {
+        return a_dir < b_dir ? -1 : 1;
+    }
+    return strcmp(a + a_dir, b + b_dir);
+}
+
+
+static int compare_index_order(const void *a, const void *b)
+{
+    return compare_index_path((*(FileNode * const *) a)->archive_path, (*(FileNode * const *) b)->archive_path);
+}
+
+
+// Check if two paths are in the same directory
+static bool same_directory(const char *a, const char *b)
+{
+    const char *a_name = strrchr(a, '/');
+    const char *b_name = strrchr(b, '/');
+    size_t a_dir = a_name ? (size_t) (a_name - a) : 0;
+    size_t b_dir = b_name ? (size_t) (b_name - b) : 0;
+    return a_dir == b_dir && memcmp(a, b, a_dir) == 0;
+}
+
+
+// Check that a path from an archive stays below the directory it is extracted to. Leading '/' are ignored, after
+// them every component must be a name, not empty and not "." or ".."
+static bool is_safe_path(const char *file_path)
+{
+    while (*file_path == '/')
+    {
+        file_path++;
+    }
+    const char *component = file_path;
+    while (true)
+    {
+        const char *end = strchr(component, '/');
+        size_t len = end ? (size_t) (end - component) : strlen(component);
+        if (len == 0 || (len == 1 && component[0] == '.') || (len == 2 && component[0] == '.' && component[1] == '.'))
+        {
+            return false;
+        }
+        if (!end)
+        {
+            return true;
+        }
+        component = end + 1;
+    }
+}
+
+
+// Make sure the directory of an extracted file exists and return a descriptor of it in dir_fd, to create the file
+// with openat(). Directories are created once with mkdirat() relative to their cached parent directory, so there is
+// no chdir() or getcwd() per file and extracting many files into the same directories costs a hash lookup each.
+// Leading '/' are ignored, all paths are extracted relative to the current directory
+static int validate_file_path(DirCache *cache, const char *file_path, int *dir_fd)
+{
+    while (*file_path == '/')
+    {
+        file_path++;
+    }
+
+    const char *name = strrchr(file_path, '/');
+    if (!name)
+    {
+        *dir_fd = AT_FDCWD;
+        return 0;
+    }
+    *dir_fd = get_directory(cache, file_path, name - file_path);
+    return *dir_fd == -1 ? 1 : 0;
+}
+
+
+// Return a descriptor of the directory path[0..len), creating it and any missing parent directories.
+// Returns -1 with errno set on errors
+static int get_directory(DirCache *cache, const char *path, size_t len)
+{
+    // Trailing and repeated '/' do not name another directory
+    while (len > 0 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    if (len == 0)
+    {
+        return AT_FDCWD;
+    }
+
+    DirCacheEntry *entry = dir_cache_find(cache, path, len);
+    if (entry->path && entry->fd != -1)
+    {
+        return entry->fd;
+    }
+
+    // Keep the number of open directory descriptors bounded, the set of created directories stays
+    if (cache->open_fds >= DIR_CACHE_MAX_FDS)
+    {
+        dir_cache_close_fds(cache);
+    }
+
+    int fd;
+    if (entry->path) // Created before, only the descriptor was closed
+    {
+        char dir_path[MAX_PATH_LEN + 1];
+        memcpy(dir_path, path, len);
+        dir_path[len] = '\0';
+        fd = open(dir_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        // Create the parent first, then this directory inside it
+        const char *slash = memrchr(path, '/', len);
+        size_t parent_len = slash ? (size_t) (slash - path) : 0;
+        int parent_fd = get_directory(cache, path, parent_len);
+        if (parent_fd == -1)
+        {
+            return -1;
+        }
+
+        char name[MAX_PATH_LEN + 1];
+        size_t name_start = slash ? parent_len + 1 : 0;
+        memcpy(name, path + name_start, len - name_start);
+        name[len - name_start] = '\0';
+        if (mkdirat(parent_fd, name, 0777) != 0 && errno != EEXIST)
+        {
+            return -1;
+        }
+        fd = openat(parent_fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return -1;
+        }
+
+        // The table may have grown while creating the parents, so look the slot up again
+        entry = dir_cache_insert(cache, path, len);
+        if (!entry)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    entry->fd = fd;
+    cache->open_fds++;
+    return fd;
+}
+
+
+// Find the slot of a directory path in the hash set: either its entry, or the empty slot it would go in
+static DirCacheEntry *dir_cache_find(DirCache *cache, const char *path, size_t len)
+{
+    // FNV-1a hash of the path
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char) path[i]) * 1099511628211ULL;
+    }
+
+    size_t mask = cache->capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask)
+    {
+        DirCacheEntry *entry = &cache->entries[i];
+        if (!entry->path || (entry->len == len && memcmp(entry->path, path, len) == 0))
+        {
+            return entry;
+        }
+    }
+}
+
+
+static DirCacheEntry *dir_cache_insert(DirCache *cache, const char *path, size_t len)
+{
+    // Grow the table when it gets 3/4 full
+    if ((cache->count + 1) * 4 > cache->capacity * 3)
+    {
+        DirCache grown = { .capacity = cache->capacity * 2, .count = cache->count, .open_fds = cache->open_fds };
+        grown.entries = calloc(grown.capacity, sizeof(DirCacheEntry));
+        if (!grown.entries)
+        {
+            perror("Error allocating memory for directory cache");
+            return NULL;
+        }
+        for (size_t i = 0; i < cache->capacity; i++)
+        {
+            if (cache->entries[i].path)
+            {
+                *dir_cache_find(&grown, cache->entries[i].path, cache->entries[i].len) = cache->entries[i];
+            }
+        }
+        free(cache->entries);
+        *cache = grown;
+    }
+
+    DirCacheEntry *entry = dir_cache_find(cache, path, len);
+    entry->path = strndup(path, len);
+    if (!entry->path)
+    {
+        perror("Error allocating memory for directory cache");
+        return NULL;
+    }
+    entry->len = len;
+    entry->fd = -1;
+    cache->count++;
+    return entry;
+}
+
+
+static int dir_cache_init(DirCache *cache)
+{
+    cache->capacity = 64;
+    cache->count = 0;
+    cache->open_fds = 0;
+    cache->entries = calloc(cache->capacity, sizeof(DirCacheEntry));
+    if (!cache->entries)
+    {
+        perror("Error allocating memory for directory cache");
+        return 1;
+    }
+    return 0;
+}
+
+
+static void dir_cache_close_fds(DirCache *cache)
+{
+    for (size_t i = 0; i < cache->capacity; i++)
+    {
+        if (cache->entries[i].path && cache->entries[i].fd != -1)
+        {
+            close(cache->entries[i].fd);
+            cache->entries[i].fd = -1;
+        }
+    }
+    cache->open_fds = 0;
+}
+
+
+static void dir_cache_free(DirCache *cache)
+{
+    dir_cache_close_fds(cache);
+    for (size_t i = 0; i < cache->capacity; i++)
+    {
+        free(cache->entries[i].path);
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->capacity = 0;
+    cache->count = 0;
+}
+
+
+// Compile a pattern once so that matching during traversal avoids fnmatch() for the common cases
+int mdarc_add_pattern(PatternList *list, const char *pattern)
+{
+    Pattern *items = realloc(list->items, (list->count + 1) * sizeof(Pattern));
+    if (!items)
+    {
+        perror("Could not allocate memory for pattern");
+        return 1;
+    }
+    list->items = items;
+
+    Pattern *pat = &list->items[list->count];
+    pat->pattern = strdup(pattern);
+    if (!pat->pattern)
+    {
+        perror("Could not allocate memory for pattern");
+        return 1;
+    }
+
+    // A trailing '/' restricts the pattern to directories, e.g. "node_modules/"
+    pat->len = strlen(pat->pattern);
+    pat->dir_only = false;
+    while (pat->len > 1 && pat->pattern[pat->len - 1] == '/')
+    {
+        pat->pattern[--pat->len] = '\0';
+        pat->dir_only = true;
+    }
+    pat->full_path = strchr(pat->pattern, '/') != NULL;
+
+    // Classify the pattern: no wildcards at all, a single leading '*' or a generic glob
+    if (strpbrk(pat->pattern, "*?[\\") == NULL)
+    {
+        pat->kind = MATCH_LITERAL;
+    }
+    else if (pat->pattern[0] == '*' && strpbrk(pat->pattern + 1, "*?[\\") == NULL)
+    {
+        pat->kind = MATCH_SUFFIX;
+        pat->len--; // compare only the text after the '*'
+    }
+    else
+    {
+        pat->kind = MATCH_GLOB;
+    }
+
+    list->count++;
+    return 0;
+}
+
+
+static bool match_pattern(const Pattern *pat, const char *path, const char *name, bool is_dir)
+{
+    if (pat->dir_only && !is_dir)
+    {
+        return false;
+    }
+
+    const char *subject = pat->full_path ? path : name;
+    switch (pat->kind)
+    {
+        case MATCH_LITERAL:
+            return strcmp(subject, pat->pattern) == 0;
+        case MATCH_SUFFIX:
+        {
+            size_t subject_len = strlen(subject);
+            return subject_len >= pat->len && memcmp(subject + subject_len - pat->len, pat->pattern + 1, pat->len) == 0;
+        }
+        default:
+            return fnmatch(pat->pattern, subject, 0) == 0;
+    }
+}
+
+
+// Check a path against the --exclude and --include patterns. Include patterns only apply to files,
+// so that directories are still descended into looking for matching files
+static bool is_filtered_out(const Options *opts, const char *path, bool is_dir)
+{
+    if (opts->exclude.count == 0 && opts->include.count == 0)
+    {
+        return false;
+    }
+
+    // Patterns without a '/' are matched against the base name only
+    const char *name = strrchr(path, '/');
+    name = (name && name[1] != '\0') ? name + 1 : path;
+
+    for (size_t i = 0; i < opts->exclude.count; i++)
+    {
+        if (match_pattern(&opts->exclude.items[i], path, name, is_dir))
+        {
+            return true;
+        }
+    }
+
+    if (is_dir || opts->include.count == 0)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < opts->include.count; i++)
+    {
+        if (match_pattern(&opts->include.items[i], path, name, is_dir))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void free_patterns(PatternList *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->items[i].pattern);
+    }
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+}
+
+
+void mdarc_free_opts(Options *opts)
+{
+    free_patterns(&opts->include);
+    free_patterns(&opts->exclude);
+    free(opts->archive_name);
+    free(opts->prefix);
+    FileNode *current = opts->file_list;
+    while (current != NULL)
+    {
+        FileNode *next = current->next;
+        free(current->file_name);
+        free(current->payload);
+        free(current->read_data);
+        free(current);
+        current = next;
+    }
+    opts->file_list = NULL;
+    opts->file_list_tail = NULL;
+}
+
+
+// Number of CPUs online, the default number of worker threads
+unsigned int mdarc_cpu_count(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+
+// Library writer: start write_archive() on a thread of its own with an empty, still growing file list
+static MdarcWriter *writer_open(FILE *archive, const MdarcWriterOptions *options)
+{
+    MdarcWriter *writer = calloc(1, sizeof(MdarcWriter));
+    if (!writer)
+    {
+        perror("Error allocating memory for archive writer");
+        close_archive(archive);
+        return NULL;
+    }
+    writer->archive = archive;
+    Options *opts = &writer->opts;
+    opts->archive_mode = true;
+    opts->r = true; // A directory is added with everything below it
+    opts->threads = options && options->threads > 0 ? options->threads : mdarc_cpu_count();
+    opts->max_memory = options ? options->max_memory : 0;
+    pthread_mutex_init(&opts->list_lock, NULL);
+    pthread_cond_init(&opts->list_changed, NULL);
+    init_compress_queue(&writer->queue, opts);
+
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0)
+    {
+        perror("Error starting archive writer");
+        close_archive(archive);
+        pthread_mutex_destroy(&opts->list_lock);
+        pthread_cond_destroy(&opts->list_changed);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+
+static void *writer_thread(void *arg)
+{
+    MdarcWriter *writer = arg;
+    writer->result = write_archive(&writer->opts, &writer->queue, writer->archive);
+    return NULL;
+}
+
+
+MdarcWriter *mdarc_writer_open(const char *archive_name, const MdarcWriterOptions *options)
+{
+    FILE *archive = fopen(archive_name, "wb");
+    if (!archive)
+    {
+        perror("Error creating archive");
+        return NULL;
+    }
+    return writer_open(archive, options);
+}
+
+
+MdarcWriter *mdarc_writer_open_fd(int fd, const MdarcWriterOptions *options)
+{
+    // A duplicate is closed with the archive, the caller's descriptor stays open
+    int archive_fd = dup(fd);
+    FILE *archive = archive_fd != -1 ? fdopen(archive_fd, "wb") : NULL;
+    if (!archive)
+    {
+        perror("Error opening archive");
+        if (archive_fd != -1)
+        {
+            close(archive_fd);
+        }
+        return NULL;
+    }
+    return writer_open(archive, options);
+}
+
+
+int mdarc_writer_add_path(MdarcWriter *writer, const char *path)
+{
+    // add_path_to_list() skips paths that do not exist, like the -T list does, a library caller gets an error
+    struct stat path_stat;
+    if (stat(path, &path_stat) != 0)
+    {
+        fprintf(stderr, "Error retrieving file information for %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    return add_path_to_list(path, &writer->opts);
+}
+
+
+int mdarc_writer_add_buffer(MdarcWriter *writer, const char *name, const void *data, size_t len)
+{
+    // The name is stored as the path of the entry. add_file_to_list() cleans it up like a file path and rejects it
+    // if no name is left
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > MAX_PATH_LEN)
+    {
+        fprintf(stderr, "Error: invalid entry name, skipping %s\n", name);
+        return 1;
+    }
+
+    // The copy is compressed like a file read ahead by the io_uring reader, and freed after compression. It counts
+    // against max_memory from here on
+    reserve_added_memory(&writer->queue, len);
+    unsigned char *copy = malloc(len > 0 ? len : 1);
+    if (!copy)
+    {
+        perror("Error allocating memory for entry data");
+        release_memory(&writer->queue, len);
+        return 1;
+    }
+    memcpy(copy, data, len);
+    if (add_file_to_list(&writer->opts, (char *) name, len, copy) != 0)
+    {
+        free(copy);
+        release_memory(&writer->queue, len);
+        return 1;
+    }
+    return 0;
+}
+
+
+int mdarc_writer_close(MdarcWriter *writer)
+{
+    // Complete the list, the writer thread then writes the last entries and the index
+    Options *opts = &writer->opts;
+    pthread_mutex_lock(&opts->list_lock);
+    opts->list_complete = true;
+    pthread_cond_broadcast(&opts->list_changed);
+    pthread_mutex_unlock(&opts->list_lock);
+    pthread_join(writer->thread, NULL);
+
+    int ret = writer->result;
+    mdarc_free_opts(opts);
+    pthread_mutex_destroy(&opts->list_lock);
+    pthread_cond_destroy(&opts->list_changed);
+    free(writer);
+    return ret;
+}
+
+
+MdarcReader *mdarc_reader_open(const char *archive_name)
+{
+    MdarcReader *reader = calloc(1, sizeof(MdarcReader));
+    if (!reader)
+    {
+        perror("Error allocating memory for archive reader");
+        return NULL;
+    }
+    if (open_archive(archive_name, &reader->in) != 0)
+    {
+        free(reader);
+        return NULL;
+    }
+    if (!reader->in.seekable || open_archive_index(&reader->in, &reader->index) != 0)
+    {
+        fprintf(stderr, "Error: %s has no readable index\n", archive_name);
+        close_archive(reader->in.file);
+        free(reader);
+        return NULL;
+    }
+
+    reader->block = malloc(DATA_BLOCK_SIZE);
+    reader->compressed_block = malloc(compressBound(DATA_BLOCK_SIZE));
+    if (!reader->block || !reader->compressed_block)
+    {
+        perror("Error allocating memory for file data");
+        mdarc_reader_close(reader);
+        return NULL;
+    }
+    reader->stream = inflate_stream_init(&reader->inflate_state);
+    return reader;
+}
+
+
+int mdarc_reader_next(MdarcReader *reader, MdarcEntry *entry)
+{
+    // Move on to the next index block after the last entry of one
+    ArchiveIndex *index = &reader->index;
+    while (reader->next_block < index->block_count &&
+           reader->next_entry == index->blocks[reader->next_block].entry_count)
+    {
+        reader->next_block++;
+        reader->next_entry = 0;
+    }
+    if (reader->next_block == index->block_count)
+    {
+        return 0;
+    }
+
+    // mdarc_reader_find() can load another block in between, loading is skipped if the block is still there
+    if (load_index_block(index, reader->next_block) != 0)
+    {
+        return -1;
+    }
+    reader_set_entry(reader, &index->entries[reader->next_entry++], entry);
+    return 1;
+}
+
+
+int mdarc_reader_find(MdarcReader *reader, const char *path, MdarcEntry *entry)
+{
+    IndexEntry *index_entry;
+    int ret = find_index_entry(&reader->index, path, &index_entry);
+    if (ret == 1)
+    {
+        reader_set_entry(reader, index_entry, entry);
+    }
+    return ret;
+}
+
+
+// Fill in a public entry from an index entry, with a copy of the path that stays valid when other blocks are loaded
+static void reader_set_entry(MdarcReader *reader, const IndexEntry *index_entry, MdarcEntry *entry)
+{
+    strcpy(reader->path, index_entry->path);
+    entry->path = reader->path;
+    entry->header_offset = index_entry->header_offset;
+    entry->size = index_entry->original_size;
+    entry->compressed_size = index_entry->compressed_size;
+    entry->checksum = index_entry->checksum;
+}
+
+
+// Decompress an entry into out, checking it against its entry header and data descriptor
+static int reader_extract(MdarcReader *reader, const MdarcEntry *entry, FILE *out)
+{
+    uint64_t original_size;
+    if (fseeko(reader->in.file, entry->header_offset, SEEK_SET) != 0)
+    {
+        perror("Error reading archive");
+        return 1;
+    }
+    reader->in.offset = entry->header_offset;
+    char file_path[MAX_PATH_LEN + 1];
+    if (read_entry_header(&reader->in, file_path, &original_size, NULL) != 1 || strcmp(file_path, entry->path) != 0)
+    {
+        fprintf(stderr, "Error: corrupt archive (index does not match entry)\n");
+        return 1;
+    }
+    return write_entry_data(&reader->in, out, reader->block, reader->compressed_block, reader->stream);
+}
+
+
+int mdarc_reader_extract_fd(MdarcReader *reader, const MdarcEntry *entry, int fd)
+{
+    int out_fd = dup(fd);
+    FILE *out = out_fd != -1 ? fdopen(out_fd, "wb") : NULL;
+    if (!out)
+    {
+        perror("Error opening output");
+        if (out_fd != -1)
+        {
+            close(out_fd);
+        }
+        return 1;
+    }
+    int ret = reader_extract(reader, entry, out);
+    if (fclose(out) != 0 && ret == 0)
+    {
+        perror("Error writing output");
+        ret = 1;
+    }
+    return ret;
+}
+
+
+int mdarc_reader_extract_buffer(MdarcReader *reader, const MdarcEntry *entry, void **data, size_t *len)
+{
+    // The stdio output of write_entry_data() goes into a growing memory buffer
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buffer, &size);
+    if (!out)
+    {
+        perror("Error allocating memory for entry data");
+        return 1;
+    }
+    int ret = reader_extract(reader, entry, out);
+    if (fclose(out) != 0 || ret != 0)
+    {
+        free(buffer);
+        return 1;
+    }
+    *data = buffer;
+    *len = size;
+    return 0;
+}
+
+
+void mdarc_reader_close(MdarcReader *reader)
+{
+    if (reader->stream)
+    {
+        inflateEnd(reader->stream);
+    }
+    free(reader->block);
+    free(reader->compressed_block);
+    close_archive_index(&reader->index);
+    close_archive(reader->in.file);
+    free(reader);
+}
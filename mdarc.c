@@ -1,64 +1,67 @@
-#include <dirent.h> // to use struct dirent, opendir(), readdir(), closedir()
-#include <errno.h> // to use errno, EEXIST for mkdir()
-#include <glob.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/stat.h> // to use struct stat, stat(), S_ISREG(), S_ISDIR()
-#include <sys/types.h>
-#include <unistd.h> // to use getopt()
-#include <zlib.h> // to use compress() and uncompress()
-
-#define VERSION "v0.5"
-
-typedef struct FileNode
-{
-    char *file_name;
-    struct FileNode *next;
-} FileNode;
-
-typedef struct
-{
-    bool archive_mode;
-    bool unarchive_mode;
-    bool a; // add files to existing archive TODO
-    bool d; // delete files from existing archive TODO
-    bool r; // recurse into directories
-    bool p; // input password TODO
-    bool l; // list files in an archive without extracting
-    char *password;
-    char *archive_name;
-    FileNode *file_list; // Linked list for all matched files
-    unsigned int file_count;
-} Options;
-
-void archive_files(Options *opts);
-void add_file_to_archive(FILE *archive, const char *file_path);
-void unarchive_files(Options *opts);
-int validate_file_path(const char* file_path);
+// mdarc command line program. Parses the command line and runs the commands of libmdarc
+#include "mdarc_internal.h"
+#include <ctype.h> // to use toupper() for size suffixes
+#include <getopt.h> // to use getopt_long()
 
 void print_usage(char *errmsg); // Print program syntax, Accepts input for a custom error message
-
 int parse_options(int argc, char *argv[], Options *opts);
+int parse_size(const char *text, uint64_t *size);
+int set_prefix(Options *opts, const char *dir);
 int read_file_list(int argc, char *argv[], Options *opts);
+int run_command(Options *opts);
+int run_batch(int argc, char *argv[]);
 
-int expand_wildcards_and_add(const char *pattern, Options *opts);
-int add_file_to_list(Options *opts, char *file_path);
-void traverse_directory(const char *dir_path, Options *opts);
 
-void free_opts(Options *opts);
+// Job of mdarc batch, one line of the job file split into a command line
+typedef struct
+{
+    unsigned int line; // Line number in the job file, for error messages
+    int argc;
+    char **argv; // argv[0] is "mdarc", followed by the words of the line
+    char *words; // Copy of the line the argv strings point into
+} BatchJob;
+
+// Jobs shared by the job runner threads, each runner takes the next job until none are left
+typedef struct
+{
+    BatchJob *jobs;
+    unsigned int count;
+    unsigned int next;
+    unsigned int failed;
+    unsigned int runners; // Job runner threads started
+    unsigned int running; // Jobs running right now
+    unsigned int cpus;
+    pthread_mutex_t lock;
+} BatchQueue;
+
+int split_job_line(const char *line, BatchJob *job);
+int read_batch_jobs(const char *path, BatchQueue *queue);
+int run_batch_job(BatchJob *job, unsigned int threads);
+void *batch_runner(void *arg);
 
 
 int main(int argc, char *argv[])
 {
+    // mdarc batch runs the jobs of a job file, each with its own command line
+    if (argc >= 2 && strcmp(argv[1], "batch") == 0)
+    {
+        return run_batch(argc, argv);
+    }
+
     Options opts = {0}; //Initialize all values in opts to false/NULL/0
+    pthread_mutex_init(&opts.list_lock, NULL);
+    pthread_cond_init(&opts.list_changed, NULL);
 
     // Parse command line options
     if (parse_options(argc, argv, &opts) != 0)
     {
         return 1;
     }
+    mdarc_stats_enabled = opts.stats;
+    mdarc_trace_enabled = opts.trace_file != NULL;
+    mdarc_progress_enabled = opts.progress > 0 && opts.archive_mode;
+    uint64_t start = mdarc_stats_clock();
+    mdarc_trace_thread("main");
 
     // Read file list
     if (read_file_list(argc, argv, &opts) != 0)
@@ -66,171 +69,46 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    // Execute archive or unarchive depending on mode selection
-    if (opts.archive_mode)
+    // Execute archive, unarchive or test depending on mode selection
+    int ret = run_command(&opts);
+    if (opts.stats)
     {
-        archive_files(&opts);
+        mdarc_print_stats(start);
     }
-    else if (opts.unarchive_mode)
+    if (opts.trace_file && mdarc_write_trace(opts.trace_file, start) != 0)
     {
-        unarchive_files(&opts);
+        ret = 1;
     }
 
-    free_opts(&opts);
-    return 0;
+    mdarc_free_opts(&opts);
+    return ret;
 }
 
 
-void archive_files(Options *opts)
+// Run the command selected by parse_options() on the files of read_file_list()
+int run_command(Options *opts)
 {
-    // OPEN archive file in write binary mode
-    FILE *archive = fopen(opts->archive_name, "wb");
-
-    // Check if archive file opened correctly
-    if (!archive)
+    if (opts->archive_mode)
     {
-        perror("Error creating archive");
-        return;
+        return mdarc_archive_files(opts);
     }
-
-    // Iterate through file list and add each file to archive
-    FileNode *current = opts->file_list;
-    while (current != NULL)
+    else if (opts->unarchive_mode)
     {
-        add_file_to_archive(archive, current->file_name);
-        FileNode *next = current->next;
-        current = next;
+        return mdarc_unarchive_files(opts);
     }
-
-    fclose(archive);
-}
-
-
-void add_file_to_archive(FILE *archive, const char *file_path)
-{
-    FILE *file = fopen(file_path, "rb");
-    if (!file)
-    {
-        perror("Error opening file");
-        return;
-    }
-
-    // Get size of the file
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // Allocate memory to read the file
-    unsigned char *file_data = (unsigned char *) malloc(file_size);
-    // Read file contents into memory and check if read correctly
-    if (fread(file_data, 1, file_size, file) != file_size)
-    {
-        perror("Error reading file");
-        free(file_data);
-        fclose(file);
-        return;
-    }
-    fclose(file);
-
-    // Allocate memory and compress data
-    uLongf compressed_size = compressBound(file_size);
-    unsigned char *compressed_data = (unsigned char *) malloc(compressed_size);
-    if (compress(compressed_data, &compressed_size, file_data, file_size) != Z_OK)
-    {
-        perror("Error compressing file");
-        free(file_data);
-        free(compressed_data);
-        return;
-    }
-    // Free file data memory
-    free(file_data);
-
-    // Write file metadata (file path, original file size, compressed size) to archive
-    fprintf(archive, "%s\n%ld\n%lu\n", file_path, file_size, compressed_size);
-
-    // WRITE file data to archive
-    fwrite(compressed_data, 1, compressed_size, archive);
-
-    // Free compressed data memory
-    free(compressed_data);
-}
-
-
-void unarchive_files(Options *opts)
-{
-    // Open archive file and check if opened correctly
-    FILE *archive = fopen(opts->archive_name, "rb");
-    if (!archive)
+    else if (opts->test_mode)
     {
-        perror("Error opening archive");
-        return;
+        return mdarc_test_archive(opts);
     }
-
-    char file_path[1024];
-    long file_size;
-    uLong compressed_size;
-
-    if (opts->l) // List contents of archive without extracting
+    else if (opts->cat_mode)
     {
-        printf("\nArchive contents:\n\n");
-        while(fscanf(archive, "%1023s\n%ld\n%lu\n", file_path, &file_size, &compressed_size) == 3)
-        {
-            printf("%s\n", file_path);
-            fseek(archive, compressed_size, SEEK_CUR);
-        }
-        printf("\n");
+        return mdarc_cat_archive(opts);
     }
-    else // Extract archive contents
+    else if (opts->grep_mode)
     {
-        // While reading archive metadadta (file path, original file size, compressed size)
-        while (fscanf(archive, "%1023s\n%ld\n%lu\n", file_path, &file_size, &compressed_size) == 3)
-        {
-            // Validate file path exists and recreate any missing subdirectorie if necessary
-            if (validate_file_path(file_path) != 0)
-            {
-                perror("Unable to create directory structure");
-                fclose(archive);
-                return;
-            }
-
-
-            // Allocate memory and read compressed data
-            unsigned char *compressed_data = (unsigned char *) malloc(compressed_size);
-            if (fread(compressed_data, 1, compressed_size, archive) != compressed_size)
-            {
-                perror("Error reading compressed data");
-                free(compressed_data);
-                fclose(archive);
-                return;
-            }
-
-            // Allocate memory to decompress data
-            unsigned char *file_data = (unsigned char *) malloc(file_size);
-            if (uncompress(file_data, (uLongf *) &file_size, compressed_data, compressed_size) != Z_OK)
-            {
-                perror("Error decompressing file");
-                free(compressed_data);
-                free(file_data);
-                fclose(archive);
-                return;
-            }
-            free(compressed_data);
-
-            // Write data to a new file (with proper check) and close new file
-            FILE *file = fopen(file_path, "wb");
-            if (!file)
-            {
-                perror("Error creating file");
-                free(file_data);
-                fclose(archive);
-                return;
-            }
-            fwrite(file_data, 1, file_size, file);
-            fclose(file);
-            free(file_data);
-        }
+        return mdarc_grep_archive(opts);
     }
-    fclose(archive);
+    return 0;
 }
 
 
@@ -242,18 +120,50 @@ void print_usage(char *errmsg)
     }
     printf("\n mdarc Program version: %s\n\n", VERSION);
     printf("Syntax:\n");
-    printf("  mdarc (command) [-options] [password] <archive_name> <file1>, <file2>, ...\n\n");
+    printf("  mdarc (command) [-options] [password] <archive_name> <file1>, <file2>, ...\n");
+    printf("  <archive_name> \"-\" writes the archive to stdout, or reads it from stdin\n\n");
     printf("Commands:\n");
     printf("  archive - archive specified files/folders into <archive_name>\n");
-    printf("  unarchive - unarchives the specified <archive_name>\n\n");
+    printf("  unarchive - unarchives the specified <archive_name>\n");
+    printf("  test - decompresses <archive_name> in memory and verifies the checksum of every file\n");
+    printf("  cat - writes the files <file1>, <file2>, ... stored in <archive_name> to stdout\n");
+    printf("  grep - mdarc grep [-E] <pattern> <archive_name> [file1] ... prints the lines of the archived files\n");
+    printf("         containing <pattern>, optionally only in the files matching file1, ...\n");
+    printf("  batch - mdarc batch [-j num] [--stats] [--trace file] <job_file> runs the archive, unarchive and test\n");
+    printf("          jobs of job_file, one mdarc command line per line without \"mdarc\", num jobs at a time\n");
+    printf("          (default: number of CPUs). Unless its line has -j, a job gets the CPUs divided by the number\n");
+    printf("          of jobs running with it as threads, set when it starts. Jobs run at the same time and in no\n");
+    printf("          fixed order, so the lines must be independent: no job may read an archive that another job\n");
+    printf("          of the batch writes (e.g. \"archive x.arc d\" and \"test x.arc\" need two batches)\n\n");
     printf("Options for archive mode:\n");
     printf("  -a      Add files to an existing archive /TODO/\n");
     printf("  -d      Delete files from an existing archive /TODO/\n");
     printf("  -r      Recursively include files in subdirectories\n");
-    printf("  -p pwd  Password protect the archive /TODO/\n\n");
+    printf("  -p pwd  Password protect the archive /TODO/\n");
+    printf("  -T file Read the list of files to archive from file, one per line (\"-\" for stdin)\n");
+    printf("  -j num  Number of compression threads (default: number of CPUs)\n");
+    printf("  --null  Paths in the -T file are separated by '\\0' instead of newlines\n");
+    printf("  --read-order inode|extent  Read files in order of inode number or position on disk\n");
+    printf("  --io-uring  Read small files in batches through io_uring (Linux), falls back to regular reads\n");
+    printf("  --include pattern  Only archive files matching pattern (can be repeated)\n");
+    printf("  --exclude pattern  Skip files and directories matching pattern (can be repeated)\n");
+    printf("  --max-memory size  Limit the memory held in data buffers, for example 512M (also for unarchive)\n");
+    printf("  --progress[=sec]  Print bytes and files done, throughput and ETA every sec seconds (default 1)\n\n");
     printf("Options for unarchive mode:\n");
     printf("  -l      List contents of the archive\n");
+    printf("  -j num  Number of decompression threads, also for test mode (default: number of CPUs)\n");
+    printf("  --direct-io  Write files of 64 MB and more with O_DIRECT, bypassing the page cache\n");
+    printf("  --prefix dir  Only list (-l), extract or test the files below dir, found through the sorted index\n");
+    printf("  --max-memory size  Limit the memory held in decode buffers, also for test mode\n");
     printf("  -p pwd  Password to access the archive /TODO/\n\n");
+    printf("Options for all modes:\n");
+    printf("  --stats Print the time spent in every phase (walk, read, compress, write, ...) at the end\n");
+    printf("  --trace file  Write a timeline of every thread to file, to be opened in Perfetto (ui.perfetto.dev).\n");
+    printf("          A finished thread hands its timeline on to the next new thread. At most 128 threads are\n");
+    printf("          traced at a time, the spans of threads started beyond that are left out with a warning\n\n");
+    printf("Options for grep mode:\n");
+    printf("  -E      <pattern> is an extended regular expression instead of a fixed string\n");
+    printf("  -j num  Number of search threads (default: number of CPUs)\n\n");
 }
 
 
@@ -274,15 +184,49 @@ int parse_options(int argc, char *argv[], Options *opts)
     {
         opts->unarchive_mode = true;
     }
+    else if (strcmp(argv[1], "test") == 0)
+    {
+        opts->test_mode = true;
+    }
+    else if (strcmp(argv[1], "cat") == 0)
+    {
+        opts->cat_mode = true;
+    }
+    else if (strcmp(argv[1], "grep") == 0)
+    {
+        opts->grep_mode = true;
+    }
     else
     {
         print_usage("Unknown command");
         return 1;
     }
 
+    // Long options without a short equivalent use values outside the char range
+    enum
+    {
+        OPT_INCLUDE = 256, OPT_EXCLUDE, OPT_NULL, OPT_IO_URING, OPT_READ_ORDER, OPT_DIRECT_IO, OPT_MAX_MEMORY,
+        OPT_STATS, OPT_TRACE, OPT_PROGRESS, OPT_PREFIX
+    };
+    static const struct option long_options[] =
+    {
+        {"include", required_argument, NULL, OPT_INCLUDE},
+        {"exclude", required_argument, NULL, OPT_EXCLUDE},
+        {"null", no_argument, NULL, OPT_NULL},
+        {"io-uring", no_argument, NULL, OPT_IO_URING},
+        {"read-order", required_argument, NULL, OPT_READ_ORDER},
+        {"direct-io", no_argument, NULL, OPT_DIRECT_IO},
+        {"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {"progress", optional_argument, NULL, OPT_PROGRESS},
+        {"prefix", required_argument, NULL, OPT_PREFIX},
+        {NULL, 0, NULL, 0}
+    };
+
     // Parse command line options
     int opt;
-    while ((opt = getopt(argc, argv, "adrp:l")) != -1)
+    while ((opt = getopt_long(argc, argv, "adrp:lT:j:E", long_options, NULL)) != -1)
     {
         switch(opt)
         {
@@ -302,6 +246,87 @@ int parse_options(int argc, char *argv[], Options *opts)
             case 'l':
                 opts->l = true;
                 break;
+            case 'E':
+                opts->regex = true;
+                break;
+            case 'T':
+                opts->list_file = optarg;
+                break;
+            case 'j':
+                if (atoi(optarg) <= 0)
+                {
+                    print_usage("Number of threads must be a positive number");
+                    return 1;
+                }
+                opts->threads = atoi(optarg);
+                break;
+            case OPT_NULL:
+                opts->null_separated = true;
+                break;
+            case OPT_IO_URING:
+                opts->io_uring = true;
+                break;
+            case OPT_DIRECT_IO:
+                opts->direct_io = true;
+                break;
+            case OPT_STATS:
+                opts->stats = true;
+                break;
+            case OPT_TRACE:
+                opts->trace_file = optarg;
+                break;
+            case OPT_PROGRESS:
+                if (optarg && atoi(optarg) <= 0)
+                {
+                    print_usage("Progress interval must be a positive number of seconds");
+                    return 1;
+                }
+                opts->progress = optarg ? atoi(optarg) : 1;
+                break;
+            case OPT_PREFIX:
+                if (set_prefix(opts, optarg) != 0)
+                {
+                    return 1;
+                }
+                break;
+            case OPT_MAX_MEMORY:
+                if (parse_size(optarg, &opts->max_memory) != 0 || opts->max_memory == 0)
+                {
+                    print_usage("Memory limit must be a positive size, for example 512M or 2G");
+                    return 1;
+                }
+                break;
+            case OPT_READ_ORDER:
+                if (strcmp(optarg, "inode") == 0)
+                {
+                    opts->read_order = READ_ORDER_INODE;
+                }
+                else if (strcmp(optarg, "extent") == 0)
+                {
+                    opts->read_order = READ_ORDER_EXTENT;
+                }
+                else if (strcmp(optarg, "list") == 0)
+                {
+                    opts->read_order = READ_ORDER_LIST;
+                }
+                else
+                {
+                    print_usage("Unknown read order, use inode, extent or list");
+                    return 1;
+                }
+                break;
+            case OPT_INCLUDE:
+                if (mdarc_add_pattern(&opts->include, optarg) != 0)
+                {
+                    return 1;
+                }
+                break;
+            case OPT_EXCLUDE:
+                if (mdarc_add_pattern(&opts->exclude, optarg) != 0)
+                {
+                    return 1;
+                }
+                break;
             default:
                 print_usage("Unknown option");
                 return 1;
@@ -310,46 +335,164 @@ int parse_options(int argc, char *argv[], Options *opts)
 
     // TODO options error handling - handle mutually exclusive options, repeating of options
 
+    // Default to one compression (or decompression) thread per CPU
+    if (opts->threads == 0)
+    {
+        opts->threads = mdarc_cpu_count();
+    }
+
+    // getopt_long() has moved the command and the other arguments behind the options
+    opts->arg_index = optind;
+    return 0;
+}
+
+
+// Set the directory of --prefix, stored with exactly one trailing '/' so that only the entries below it match and
+// not those of a directory whose name merely starts the same. Returns 1 if it is not a directory name
+int set_prefix(Options *opts, const char *dir)
+{
+    size_t len = strlen(dir);
+    while (len > 0 && dir[len - 1] == '/')
+    {
+        len--;
+    }
+    if (len == 0)
+    {
+        print_usage("--prefix needs the path of a directory in the archive");
+        return 1;
+    }
+    free(opts->prefix);
+    opts->prefix = malloc(len + 2);
+    if (!opts->prefix)
+    {
+        perror("Error allocating memory for prefix");
+        return 1;
+    }
+    memcpy(opts->prefix, dir, len);
+    opts->prefix[len] = '/';
+    opts->prefix[len + 1] = '\0';
+    return 0;
+}
+
+
+// Parse a size in bytes with an optional K, M or G suffix (powers of 1024). Returns 1 if it is not a valid size
+int parse_size(const char *text, uint64_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || errno != 0 || text[0] == '-')
+    {
+        return 1;
+    }
+    unsigned int shift = 0;
+    switch (toupper((unsigned char) *end))
+    {
+        case '\0':
+            break;
+        case 'K':
+            shift = 10;
+            break;
+        case 'M':
+            shift = 20;
+            break;
+        case 'G':
+            shift = 30;
+            break;
+        default:
+            return 1;
+    }
+    if (*end != '\0' && end[1] != '\0')
+    {
+        return 1;
+    }
+    if (value > (UINT64_MAX >> shift))
+    {
+        return 1;
+    }
+    *size = (uint64_t) value << shift;
     return 0;
 }
 
 
 int read_file_list(int argc, char *argv[], Options *opts)
 {
+    // grep takes the search pattern before the archive name
+    if (opts->grep_mode)
+    {
+        if (opts->arg_index + 1 >= argc)
+        {
+            fprintf(stderr, "Error: Missing search pattern\n");
+            return 1;
+        }
+        opts->pattern = argv[opts->arg_index + 1];
+        opts->arg_index++;
+    }
+
     // Validate that archive name exists in arguments
-    if (optind + 1 >= argc)
+    if (opts->arg_index + 1 >= argc)
     {
         fprintf(stderr, "Error: Missing archive name\n");
         return 1;
     }
-    opts->archive_name = strdup(argv[optind+1]); // Assign (duplicate) archive name
+    opts->archive_name = strdup(argv[opts->arg_index+1]); // Assign (duplicate) archive name
     if (!opts->archive_name)
     {
         perror("Error allocating memory for archive name");
         return 1;
     }
 
+    // cat and grep name files inside the archive, they are looked up there and not on disk
+    if (opts->cat_mode || opts->grep_mode)
+    {
+        if (opts->arg_index + 2 >= argc && opts->cat_mode)
+        {
+            fprintf(stderr, "Error: No files specified to write from archive\n");
+            return 1;
+        }
+        opts->members = &argv[opts->arg_index + 2];
+        opts->member_count = argc - opts->arg_index - 2;
+        return 0;
+    }
+
     opts->file_list = NULL; // Initialize file list
+    opts->file_list_tail = NULL;
     opts->file_count = 0; // Initialize file count
 
+    // Open the -T manifest now, so a bad name is reported before the archive is created
+    if (opts->list_file && opts->archive_mode)
+    {
+        opts->list_stream = strcmp(opts->list_file, "-") == 0 ? stdin : fopen(opts->list_file, "r");
+        if (!opts->list_stream)
+        {
+            perror("Error opening file list");
+            return 1;
+        }
+    }
+
     // Validate file(s) and/or patterns are provided as arguments
-    if (optind + 2 >= argc && opts->archive_mode)
+    if (opts->arg_index + 2 >= argc && opts->archive_mode && !opts->list_stream)
     {
         fprintf(stderr, "Error: No files specified to add to archive\n");
         return 1;
     }
 
     // Read file list
-    for (int i = optind + 2; i < argc; i++)
+    uint64_t start = mdarc_stats_clock();
+    for (int i = opts->arg_index + 2; i < argc; i++)
     {
         // Treat every file input as a wildcard
-        if (expand_wildcards_and_add(argv[i], opts) != 0)
+        if (mdarc_expand_wildcards_and_add(argv[i], opts) != 0)
         {
             return 1;
         }
     }
+    mdarc_stats_add(STAT_WALK, start, opts->file_count, 0);
 
-    if (opts->file_count == 0 && opts->archive_mode)
+    // Paths from the manifest are added while archiving, otherwise the list is complete here
+    opts->list_complete = opts->list_stream == NULL;
+
+    if (opts->file_count == 0 && opts->archive_mode && !opts->list_stream)
     {
         fprintf(stderr,"Error: no files matched input filenames or patterns. Archive not created\n");
         return 1;
@@ -359,223 +502,345 @@ int read_file_list(int argc, char *argv[], Options *opts)
 }
 
 
-// Function to expand wildcard patterns
-int expand_wildcards_and_add(const char *pattern, Options *opts)
+// getopt_long() keeps its state in globals, so only one job parses its command line at a time
+pthread_mutex_t batch_parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Split a job line into words at spaces and tabs, "double quotes" keep spaces in a word. Returns 1 on errors
+int split_job_line(const char *line, BatchJob *job)
 {
-    struct stat path_stat;
-    if (stat(pattern, &path_stat) == 0 && S_ISDIR(path_stat.st_mode))
+    // Every word needs at least two characters of the line (the word and a separator), plus "mdarc" and NULL
+    size_t len = strlen(line);
+    job->words = malloc(len + 1);
+    job->argv = malloc((len / 2 + 3) * sizeof(char *));
+    if (!job->words || !job->argv)
     {
-        // The pattern is a directory, traverse it
-        traverse_directory(pattern, opts);
-        return 0;
+        perror("Error allocating memory for batch job");
+        return 1;
     }
 
-    // Handle file patterns (if not a directory)
-    glob_t results;
-    int ret = glob(pattern, 0, NULL, &results);
-
-    if (ret != 0)
+    job->argc = 0;
+    job->argv[job->argc++] = "mdarc";
+    char *out = job->words;
+    const char *in = line;
+    while (*in != '\0')
     {
-        if (ret == GLOB_NOMATCH)
+        // Skip the separators before the next word
+        while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
         {
-            fprintf(stderr, "No match for the pattern: %s\n", pattern);
+            in++;
         }
-        else
+        if (*in == '\0')
         {
-            perror("Error processing glob pattern");
-            return 1;
+            break;
         }
-    }
 
-    // Add matched files to the list
-    for (size_t i = 0; i < results.gl_pathc; i ++)
-    {
-        if (add_file_to_list(opts, results.gl_pathv[i]) != 0)
+        // Copy the word without its quotes
+        job->argv[job->argc++] = out;
+        bool quoted = false;
+        while (*in != '\0' && (quoted || (*in != ' ' && *in != '\t' && *in != '\n' && *in != '\r')))
         {
-            globfree(&results); // Clean up
+            if (*in == '"')
+            {
+                quoted = !quoted;
+            }
+            else
+            {
+                *out++ = *in;
+            }
+            in++;
+        }
+        *out++ = '\0';
+        if (quoted)
+        {
+            fprintf(stderr, "Error: Unterminated quote on line %u of the job file\n", job->line);
             return 1;
-        };
+        }
     }
-
-    globfree(&results); // Clean up
+    job->argv[job->argc] = NULL;
     return 0;
 }
 
 
-// Function to add file name with path into the linked list
-int add_file_to_list(Options *opts, char *file_path)
+// Read the job file, one job per line. Blank lines and lines starting with # are skipped. Returns 1 on errors
+int read_batch_jobs(const char *path, BatchQueue *queue)
 {
-    FileNode *current = opts->file_list; // Initialize current to the head of the list
-
-    // Traverse to the end of the current existing list (if any)
-    while (current && current->next != NULL)
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!file)
     {
-        current = current->next;
+        perror("Error opening job file");
+        return 1;
     }
 
-    // Allocate memory for the new node
-    FileNode *new_file = malloc(sizeof(FileNode));
-    if (new_file == NULL)
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned int capacity = 0;
+    unsigned int line_number = 0;
+    int ret = 0;
+    while (getline(&line, &line_size, file) != -1)
     {
-        perror("Could not allocate memory for file node");
-        return 1;
+        line_number++;
+        const char *text = line + strspn(line, " \t\r\n");
+        if (*text == '\0' || *text == '#')
+        {
+            continue;
+        }
+
+        // Grow the job array by doubling
+        if (queue->count == capacity)
+        {
+            unsigned int new_capacity = capacity ? capacity * 2 : 64;
+            BatchJob *jobs = realloc(queue->jobs, new_capacity * sizeof(BatchJob));
+            if (!jobs)
+            {
+                perror("Error allocating memory for batch jobs");
+                ret = 1;
+                break;
+            }
+            queue->jobs = jobs;
+            capacity = new_capacity;
+        }
+
+        BatchJob *job = &queue->jobs[queue->count++];
+        *job = (BatchJob) {.line = line_number};
+        if (split_job_line(text, job) != 0)
+        {
+            ret = 1;
+            break;
+        }
+    }
+    if (ferror(file))
+    {
+        perror("Error reading job file");
+        ret = 1;
     }
 
-    new_file->file_name = strdup(file_path); // Copy full path
-    if (new_file->file_name == NULL)
+    free(line);
+    if (file != stdin)
     {
-        perror("Could not allocate memory for file name");
-        free(new_file);
-        return 1;
+        fclose(file);
     }
+    return ret;
+}
 
-    new_file->next = NULL;
 
-    if (opts->file_list == NULL) // If first element in file list
+// Run one job of the batch like a separate mdarc command would, with threads compression or decompression threads
+// unless the job line has its own -j. Returns 1 if the job failed
+int run_batch_job(BatchJob *job, unsigned int threads)
+{
+    Options opts = {0}; //Initialize all values in opts to false/NULL/0
+    pthread_mutex_init(&opts.list_lock, NULL);
+    pthread_cond_init(&opts.list_changed, NULL);
+    opts.threads = threads;
+
+    // optind = 0 starts getopt_long() over for the command line of this job
+    pthread_mutex_lock(&batch_parse_lock);
+    optind = 0;
+    int ret = parse_options(job->argc, job->argv, &opts);
+    pthread_mutex_unlock(&batch_parse_lock);
+
+    // stdin, stdout and the process wide counters are shared by all jobs
+    if (ret == 0 && !opts.archive_mode && !opts.unarchive_mode && !opts.test_mode)
     {
-        opts->file_list = new_file;
-        current = opts->file_list;  // Initialize `current` to the new head
+        fprintf(stderr, "Error: Only archive, unarchive and test jobs can run in a batch\n");
+        ret = 1;
     }
-    else
+    if (ret == 0 && (opts.stats || opts.trace_file || opts.progress))
+    {
+        fprintf(stderr, "Error: --stats and --trace are options of the whole batch, --progress is not supported\n");
+        ret = 1;
+    }
+    if (ret == 0 && opts.list_file && strcmp(opts.list_file, "-") == 0)
+    {
+        fprintf(stderr, "Error: Jobs of a batch can not read a file list from stdin\n");
+        ret = 1;
+    }
+    if (ret == 0 && opts.arg_index + 1 < job->argc && strcmp(job->argv[opts.arg_index + 1], "-") == 0)
     {
-        current->next = new_file; // Append to the end of the list
-        current = new_file; // Update the current node
+        fprintf(stderr, "Error: Jobs of a batch can not write archives to stdout or read them from stdin\n");
+        ret = 1;
     }
 
-    opts->file_count++; // Increment file count
-    return 0;
+    if (ret == 0)
+    {
+        ret = read_file_list(job->argc, job->argv, &opts);
+    }
+    if (ret == 0)
+    {
+        ret = run_command(&opts);
+    }
+
+    mdarc_free_opts(&opts);
+    return ret;
 }
 
 
-void traverse_directory(const char *dir_path, Options *opts)
+// Job runner thread, runs jobs until the queue is empty
+void *batch_runner(void *arg)
 {
-    DIR *dir = opendir(dir_path);
-    if (!dir)
-    {
-        perror("Error opening directory");
-        return;
-    }
+    BatchQueue *queue = (BatchQueue *) arg;
+    mdarc_trace_thread("job runner");
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL)
+    while (1)
     {
-        // Skip special cases for directories "." and ".."
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        // Take the next job
+        pthread_mutex_lock(&queue->lock);
+        if (queue->next == queue->count)
         {
-            continue;
+            pthread_mutex_unlock(&queue->lock);
+            break;
         }
+        BatchJob *job = &queue->jobs[queue->next++];
 
-        // Construct full path
-        size_t path_len = strlen(dir_path);
-        size_t entry_len = strlen(entry->d_name);
-        size_t full_path_len = path_len + entry_len + 2; // +1 for '/' and +1 for '\0'
-        char *full_path = malloc(full_path_len);
-        if (!full_path)
+        // The CPUs are shared by the jobs that run next to this one: every runner while the queue is full, only
+        // the jobs still running once it drains, so the last jobs of a batch get more threads
+        queue->running++;
+        unsigned int sharing = queue->running + (queue->count - queue->next);
+        if (sharing > queue->runners)
         {
-            perror("Error allocating memory for path");
-            closedir(dir);
-            return;
+            sharing = queue->runners;
         }
+        unsigned int threads = queue->cpus / sharing > 0 ? queue->cpus / sharing : 1;
+        pthread_mutex_unlock(&queue->lock);
 
-        snprintf(full_path, full_path_len, "%s%s%s", dir_path, (dir_path[path_len - 1] == '/' ? "" : "/"), entry->d_name);
-
-        // Use stat() to determine file type
-        struct stat path_stat;
-        if (stat(full_path, &path_stat) == 0)
+        uint64_t start = mdarc_stats_clock();
+        int ret = run_batch_job(job, threads);
+        mdarc_trace_span("job", start, mdarc_stats_clock());
+        if (ret != 0)
         {
-            if (S_ISDIR(path_stat.st_mode)) // If a directory
-            {
-                if (opts->r) // Recurse only if -r specified
-                {
-                    traverse_directory(full_path, opts);
-                }
-
-            }
-            else if (S_ISREG(path_stat.st_mode)) // If a regular file
-            {
-                add_file_to_list(opts, full_path);
-            }
-            free (full_path);
-        }
-        else
-        {
-            perror("Error retrieving file information");
-            return;
+            fprintf(stderr, "Error: Job on line %u of the job file failed\n", job->line);
         }
+        pthread_mutex_lock(&queue->lock);
+        queue->running--;
+        queue->failed += ret != 0;
+        pthread_mutex_unlock(&queue->lock);
     }
-    closedir(dir);
+    return NULL;
 }
 
 
-int validate_file_path(const char* file_path)
+// mdarc batch [-j num] [--stats] [--trace file] <job_file>
+// Runs the archive, unarchive and test jobs of job_file in this process, several jobs at a time, so a new job
+// starts on a core as soon as another one finishes. Returns 1 if any job failed
+int run_batch(int argc, char *argv[])
 {
-    // Duplicate the file path to modify it safely
-    char *dir_path = strdup(file_path);
-    if (!dir_path)
+    enum
     {
-        perror("Failed allocatingn memory for path");
-        return 1;
-    }
+        OPT_STATS = 256, OPT_TRACE
+    };
+    static const struct option long_options[] =
+    {
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {NULL, 0, NULL, 0}
+    };
 
-    char initial_dir[1024];
-    if (!getcwd(initial_dir, sizeof(initial_dir)))
+    // Parse the options of the batch, behind the batch command
+    unsigned int runners = 0;
+    char *trace_file = NULL;
+    int opt;
+    while ((opt = getopt_long(argc - 1, argv + 1, "j:", long_options, NULL)) != -1)
     {
-        perror("Unable to get current directory");
-        free(dir_path);
+        switch(opt)
+        {
+            case 'j':
+                if (atoi(optarg) <= 0)
+                {
+                    print_usage("Number of jobs must be a positive number");
+                    return 1;
+                }
+                runners = atoi(optarg);
+                break;
+            case OPT_STATS:
+                mdarc_stats_enabled = true;
+                break;
+            case OPT_TRACE:
+                trace_file = optarg;
+                break;
+            default:
+                print_usage("Unknown option");
+                return 1;
+        }
+    }
+    if (optind + 2 != argc)
+    {
+        print_usage("batch takes exactly one job file");
         return 1;
     }
+    mdarc_trace_enabled = trace_file != NULL;
+    uint64_t start = mdarc_stats_clock();
+    mdarc_trace_thread("main");
 
-    char *dir_token = strtok(dir_path, "/");
-    while (dir_token != NULL)
+    // Default to one running job per CPU
+    if (runners == 0)
     {
-        char *next_token = strtok(NULL, "/");
+        runners = mdarc_cpu_count();
+    }
+
+    BatchQueue queue = {0};
+    pthread_mutex_init(&queue.lock, NULL);
+    int ret = read_batch_jobs(argv[optind + 1], &queue);
 
-        // Try to create each directory, skipping the last token which is assumed to be a filename
-        if (next_token != NULL)
+    // Start the job runners, no more than there are jobs
+    if (ret == 0)
+    {
+        if (runners > queue.count)
         {
-            // Create the directory if it does not exist
-            if (mkdir(dir_token, 0777) != 0 && errno != EEXIST)
-            {
-                perror("Unable to create director");
-                free(dir_path);
-                return 1;
-            }
-            // Change to the newly created or existing directory
-            if (chdir(dir_token) != 0)
+            runners = queue.count;
+        }
+        queue.runners = runners;
+        queue.cpus = mdarc_cpu_count();
+        pthread_t *threads = malloc(runners * sizeof(pthread_t));
+        unsigned int started = 0;
+        if (!threads && runners > 0)
+        {
+            perror("Error allocating memory for job runners");
+            ret = 1;
+        }
+        for (; ret == 0 && started < runners; started++)
+        {
+            if (pthread_create(&threads[started], NULL, batch_runner, &queue) != 0)
             {
-                perror("Unable to change directory");
-                free(dir_path);
-                return 1;
+                perror("Error creating job runner thread");
+                break;
             }
         }
-
-        // get next directory token
-        dir_token = next_token;
-    }
-
-    // Return to initial directory
-    if (chdir(initial_dir) != 0)
+        // With fewer runners the jobs still run, the started runners take the rest and share the CPUs
+        if (started == 0 && queue.count > 0)
         {
-            perror("Unable to return to initial directory");
-            free(dir_path);
-            return 1;
+            ret = 1;
         }
+        pthread_mutex_lock(&queue.lock);
+        queue.runners = started > 0 ? started : 1;
+        pthread_mutex_unlock(&queue.lock);
+        for (unsigned int i = 0; i < started; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
 
-    free(dir_path);
-    return 0;
-}
+        if (queue.failed > 0)
+        {
+            fprintf(stderr, "Error: %u of %u jobs failed\n", queue.failed, queue.count);
+            ret = 1;
+        }
+    }
 
+    if (mdarc_stats_enabled)
+    {
+        mdarc_print_stats(start);
+    }
+    if (trace_file && mdarc_write_trace(trace_file, start) != 0)
+    {
+        ret = 1;
+    }
 
-void free_opts(Options *opts)
-{
-    free(opts->archive_name);
-    FileNode *current = opts->file_list;
-    while (current != NULL)
+    for (unsigned int i = 0; i < queue.count; i++)
     {
-        FileNode *next = current->next;
-        free(current->file_name);
-        free(current);
-        current = next;
+        free(queue.jobs[i].argv);
+        free(queue.jobs[i].words);
     }
-    opts->file_list = NULL;
+    free(queue.jobs);
+    pthread_mutex_destroy(&queue.lock);
+    return ret;
 }
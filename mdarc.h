@@ -0,0 +1,83 @@
+// libmdarc - write and read mdarc archives from a program, without running the mdarc command.
+// Link with libmdarc.a -lz -lpthread
+//
+//   MdarcWriter *writer = mdarc_writer_open("backup.arc", NULL);
+//   mdarc_writer_add_path(writer, "dir1"); // Files and whole directory trees
+//   mdarc_writer_add_buffer(writer, "notes.txt", text, text_len); // Contents from memory
+//   int ret = mdarc_writer_close(writer); // Writes the index, 0 if every entry was archived
+//
+//   MdarcReader *reader = mdarc_reader_open("backup.arc");
+//   MdarcEntry entry;
+//   while (mdarc_reader_next(reader, &entry) == 1)
+//       printf("%s %llu\n", entry.path, (unsigned long long) entry.size);
+//   if (mdarc_reader_find(reader, "notes.txt", &entry) == 1)
+//       mdarc_reader_extract_buffer(reader, &entry, &data, &len);
+//   mdarc_reader_close(reader);
+//
+// Functions returning int return 0 on success and 1 on failure unless noted otherwise. Errors are reported on
+// stderr, like the mdarc command does.
+#ifndef MDARC_H
+#define MDARC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct MdarcWriter MdarcWriter;
+typedef struct MdarcReader MdarcReader;
+
+// Settings of a writer, NULL or all zero for the defaults
+typedef struct
+{
+    unsigned int threads; // Compression threads, 0 for one per CPU
+    uint64_t max_memory; // Limit for the bytes held in data buffers, 0 for no limit (see --max-memory)
+} MdarcWriterOptions;
+
+// Entry of an archive, as listed in its index
+typedef struct
+{
+    const char *path; // Owned by the reader, valid until its next call
+    uint64_t size; // Original size
+    uint64_t compressed_size; // Stored data, without block headers
+    uint32_t checksum; // CRC32C of the original data
+    uint64_t header_offset; // Position of the entry in the archive
+} MdarcEntry;
+
+// Start writing an archive to a file, or to a file descriptor that stays open after mdarc_writer_close(). The
+// compression threads start right away and compress the entries while more are added
+MdarcWriter *mdarc_writer_open(const char *archive_name, const MdarcWriterOptions *options);
+MdarcWriter *mdarc_writer_open_fd(int fd, const MdarcWriterOptions *options);
+
+// Add a file, or a directory with all files below it. Entries are stored in the order they are added. Returns 1 if
+// path does not exist or a file below it could not be read or added, the other files are still added
+int mdarc_writer_add_path(MdarcWriter *writer, const char *path);
+
+// Add an entry named name with len bytes of data. The data is copied, the buffer can be reused right away. The copy
+// counts against max_memory, the call waits while the entries added before hold the memory. name is cleaned up like
+// the path of a file: a leading '/', everything up to the last ".." and "." or empty components are removed. Returns
+// 1 if name is empty, longer than 4095 bytes or has nothing left after that
+int mdarc_writer_add_buffer(MdarcWriter *writer, const char *name, const void *data, size_t len);
+
+// Wait for all entries to be written, write the index and free the writer. Returns 1 if any entry or the
+// archive itself could not be written
+int mdarc_writer_close(MdarcWriter *writer);
+
+// Open an archive for reading. Only archive files are supported, not pipes, the entries are found through the
+// index at the end of the archive. Only its root table is read here, the index blocks are read when needed
+MdarcReader *mdarc_reader_open(const char *archive_name);
+
+// Get the next entry of the index, sorted by directory and then by file name. Returns 1 with an entry, 0 after the
+// last one and -1 on errors
+int mdarc_reader_next(MdarcReader *reader, MdarcEntry *entry);
+
+// Find the entry with the given path. Returns 1 if found, 0 if not and -1 on errors. Does not change the position
+// of mdarc_reader_next()
+int mdarc_reader_find(MdarcReader *reader, const char *path, MdarcEntry *entry);
+
+// Decompress the contents of an entry and write them to fd, or into a buffer allocated with malloc(). The
+// checksum is verified, on a mismatch 1 is returned (the data has been written to fd already)
+int mdarc_reader_extract_fd(MdarcReader *reader, const MdarcEntry *entry, int fd);
+int mdarc_reader_extract_buffer(MdarcReader *reader, const MdarcEntry *entry, void **data, size_t *len);
+
+void mdarc_reader_close(MdarcReader *reader);
+
+#endif
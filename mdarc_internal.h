@@ -0,0 +1,644 @@
+// Internals of libmdarc, shared by the library (libmdarc.c) and the mdarc command line program (mdarc.c).
+// Programs using the library only include mdarc.h
+#ifndef MDARC_INTERNAL_H
+#define MDARC_INTERNAL_H
+
+#define _GNU_SOURCE // to use statx() definitions for the io_uring reader
+#include <dirent.h> // to use struct dirent, opendir(), readdir(), closedir()
+#include <errno.h> // to use errno, EEXIST for mkdir()
+#include <fcntl.h> // to use O_RDONLY, AT_FDCWD
+#include <fnmatch.h> // to use fnmatch() for --include/--exclude patterns
+#include <glob.h>
+#include <inttypes.h> // to use PRIu64 for the test summary
+#include <pthread.h> // to use the compression worker threads
+#include <regex.h> // to use regcomp() and regexec() for grep -E
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h> // to use struct stat, stat(), S_ISREG(), S_ISDIR()
+#include <sys/types.h>
+#include <time.h> // to use clock_gettime() for the test summary and --stats
+#include <unistd.h>
+#include <zlib.h> // to use deflate() and inflate()
+
+#include "mdarc.h"
+
+// The io_uring reader talks to the kernel directly, so only the kernel headers are needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#if __has_include(<linux/fiemap.h>)
+#include <linux/fiemap.h> // to use FIEMAP for --read-order=extent
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#define HAVE_FIEMAP 1
+#endif
+#endif
+#ifndef HAVE_IO_URING
+#define HAVE_IO_URING 0
+#endif
+
+// Hardware CRC32C, selected at run time on CPUs with SSE4.2
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#else
+#define HAVE_CRC32C_SSE42 0
+#endif
+#ifndef HAVE_FIEMAP
+#define HAVE_FIEMAP 0
+#endif
+
+#define VERSION "v0.6"
+#define QUEUE_DEPTH_PER_THREAD 4 // Files compressed ahead of the archive writer, per worker thread
+#define MAX_PATH_LEN 4095 // Longest file path stored in an archive
+#define DATA_BLOCK_SIZE (1024 * 1024) // Files are compressed in independent blocks of at most this size
+#define IO_BATCH_SIZE 64 // Files opened, read and closed together by the io_uring reader
+#define MAX_READ_AHEAD (2 * IO_BATCH_SIZE) // Files read by the io_uring reader and not yet taken by a worker
+#define READ_AHEAD_MAX_SIZE (256 * 1024) // Larger files are read by the workers themselves
+#define STREAM_MIN_SIZE (64 * 1024 * 1024) // Files of this size and more are streamed, not compressed in memory
+#define DIR_CACHE_MAX_FDS 256 // Directory descriptors kept open while extracting
+#define DIRECT_IO_ALIGN 4096 // Buffer, offset and size alignment for O_DIRECT writes
+#define DIRECT_IO_MIN_SIZE (64 * 1024 * 1024) // Smallest file extracted with O_DIRECT when --direct-io is used
+#define CRC32C_POLY 0x82f63b78 // CRC32C (Castagnoli) polynomial, reversed
+#define CRC32C_LONG 8192 // Stream lengths of the interleaved hardware CRC32C
+#define CRC32C_SHORT 256
+#define TRACE_RING_SIZE (64 * 1024) // Events kept per thread by --trace, the oldest are overwritten
+#define TRACE_MAX_THREADS 128 // Rings --trace keeps at most, the rings of finished threads are reused
+#define TRACE_LABEL_LEN 48 // End of the entry path stored with every trace event
+#define PROGRESS_SMOOTHING 0.3 // Weight of the last interval in the throughput shown by --progress
+#define INDEX_BLOCK_ENTRIES 1024 // Most entries in one index block
+#define INDEX_BLOCK_MIN_ENTRIES 256 // A new index block starts at the next directory after this many entries
+
+// Archive format. All numbers are stored little endian
+//
+//   archive header  "MDARC\0", format version (1 byte), reserved (1 byte)
+//   entries         entry header: signature "MDEN", path length (u16), flags (u16), original size (u64), file path
+//                   data blocks: original length (u32), stored length (u32), data - ended by a 0/0 block.
+//                                Blocks whose stored length equals the original length are not compressed,
+//                                blocks with stored length 0 are holes of zeros in sparse files (no data)
+//                   data descriptor: signature "MDDD", original size (u64), compressed size (u64),
+//                                    CRC32C of the original data (u32)
+//   index           signature "MDIX", then the index blocks. The entries are sorted by directory, then by file
+//                   name (see compare_index_path), and split into blocks of whole directories where possible.
+//                   Every block is deflated on its own and holds for every entry: entry header offset (u64),
+//                   original size (u64), compressed size (u64), CRC32C (u32), position in the original file list
+//                   (u64, listing shows the entries in this order), length of the path prefix shared with the
+//                   previous entry of the block (u16, 0 for the first one), suffix length (u16), suffix
+//   root table      signature "MDRT", block count (u32), then for every index block: block offset (u64), stored
+//                   length (u32), original length (u32), entry count (u32), path length (u16), path of the
+//                   first entry of the block
+//   trailer         signature "MDTR", root table offset (u64), entry count (u64)
+//
+// The sizes of an entry follow its data and the index is written last, so an archive is written front to back
+// without seeking and can be sent to a pipe. Readers can extract it front to back the same way. Seekable readers
+// load only the root table and find the index block of a path in it, so a lookup reads one block of the index.
+#define ARCHIVE_MAGIC "MDARC"
+#define FORMAT_VERSION 1
+#define ENTRY_SIGNATURE 0x4e45444d // "MDEN"
+#define DESCRIPTOR_SIGNATURE 0x4444444d // "MDDD"
+#define INDEX_SIGNATURE 0x5849444d // "MDIX"
+#define ROOT_SIGNATURE 0x5452444d // "MDRT"
+#define TRAILER_SIGNATURE 0x5254444d // "MDTR"
+#define ARCHIVE_HEADER_SIZE 8
+#define ENTRY_HEADER_SIZE 16
+#define BLOCK_HEADER_SIZE 8
+#define DESCRIPTOR_SIZE 24
+#define INDEX_RECORD_SIZE 40
+#define ROOT_HEADER_SIZE 8
+#define ROOT_RECORD_SIZE 22
+#define TRAILER_SIZE 20
+#define ENTRY_FLAG_SPARSE 0x0001 // The entry has hole blocks, the file is extracted sparse
+#define HOLE_BLOCK_MAX (1024 * 1024 * 1024) // Longest hole stored in one hole block
+
+// Compression state of an entry in the file list
+typedef enum
+{
+    ENTRY_PENDING,
+    ENTRY_READY,
+    ENTRY_FAILED,
+    ENTRY_WRITTEN
+} EntryStatus;
+
+// Order in which the files are read and stored in the archive (--read-order)
+typedef enum
+{
+    READ_ORDER_LIST, // as listed on the command line / found in the directories
+    READ_ORDER_INODE, // by inode number
+    READ_ORDER_EXTENT // by location of the first extent on disk, inode number where that is not known
+} ReadOrder;
+
+// Read-ahead state of an entry when the io_uring reader is used
+typedef enum
+{
+    READ_AHEAD_PENDING,
+    READ_AHEAD_DATA, // whole file contents in read_data
+    READ_AHEAD_SKIPPED // not read ahead, the worker reads the file itself
+} ReadAhead;
+
+typedef struct FileNode
+{
+    char *file_name;
+    const char *archive_path; // file_name as stored in the archive (make_archive_path), points into file_name
+    struct FileNode *next;
+    uint64_t list_index; // Position in the original file list, kept when the list is sorted for reading
+    // Filled in by a compression worker, written to the archive and freed by mdarc_archive_files()
+    EntryStatus status;
+    unsigned char *payload; // Compressed data blocks, in archive format
+    size_t payload_size;
+    size_t payload_capacity; // Allocated size of payload, counted against --max-memory
+    bool payload_pooled; // payload is a buffer of the payload pool, otherwise malloc'ed
+    uint64_t original_size;
+    uint64_t compressed_size; // Stored block data, without block headers
+    uint32_t checksum; // CRC32C of the original data
+    bool sparse; // Holes were stored as hole blocks
+    bool stream; // Too large to compress in memory, written block by block by stream_file_to_archive()
+    uint64_t header_offset; // Position of the entry in the archive, for the index
+    // Filled in by the io_uring reader (--io-uring) before the entry is handed to a worker
+    ReadAhead read_ahead;
+    unsigned char *read_data; // Also set for entries added from memory (mdarc_writer_add_buffer)
+    size_t read_len;
+    bool read_pooled; // read_data is a buffer of the read pool, otherwise malloc'ed
+} FileNode;
+
+// Kind of test a compiled --include/--exclude pattern needs
+typedef enum
+{
+    MATCH_LITERAL, // no wildcards - plain string comparison
+    MATCH_SUFFIX,  // "*.ext" - compare the tail of the name only
+    MATCH_GLOB     // anything else - fall back to fnmatch()
+} MatchKind;
+
+typedef struct
+{
+    char *pattern;
+    size_t len; // length of the string compared by MATCH_LITERAL / MATCH_SUFFIX
+    MatchKind kind;
+    bool full_path; // pattern contains '/' - match the whole path instead of the base name
+    bool dir_only; // pattern ended with '/' - only matches directories
+} Pattern;
+
+typedef struct
+{
+    Pattern *items;
+    size_t count;
+} PatternList;
+
+typedef struct
+{
+    bool archive_mode;
+    bool unarchive_mode;
+    bool test_mode;
+    bool cat_mode;
+    bool grep_mode;
+    bool a; // add files to existing archive TODO
+    bool d; // delete files from existing archive TODO
+    bool r; // recurse into directories
+    bool p; // input password TODO
+    bool l; // list files in an archive without extracting
+    char *prefix; // --prefix - only list or extract the entries below this directory, stored with a trailing '/'
+    char *password;
+    PatternList include; // --include patterns, files must match at least one if any are given
+    PatternList exclude; // --exclude patterns, matching files and directories are skipped
+    int arg_index; // First argument after the options (the command), set by parse_options()
+    char *archive_name;
+    char **members; // File paths inside the archive (cat) or patterns for them (grep), taken from argv
+    int member_count;
+    char *pattern; // Text searched by grep, taken from argv
+    bool regex; // -E - the grep pattern is an extended regular expression
+    char *list_file; // -T manifest with one path per line ("-" for stdin)
+    FILE *list_stream; // Opened manifest, read while archiving is already running
+    bool null_separated; // --null - manifest paths are separated by '\0' instead of newlines
+    bool list_failed; // A file to archive was skipped or the -T manifest not read to the end, archiving returns 1
+    unsigned int threads; // -j - number of compression worker threads
+    bool io_uring; // --io-uring - batch small file reads through io_uring
+    ReadOrder read_order; // --read-order - sort the file list by physical location before reading
+    bool direct_io; // --direct-io - extract large files with O_DIRECT, bypassing the page cache
+    uint64_t max_memory; // --max-memory - limit for the bytes held in data buffers, 0 if there is none
+    bool stats; // --stats - print the time spent in every phase
+    char *trace_file; // --trace - write a timeline of the spans of every thread to this file
+    unsigned int progress; // --progress - seconds between progress updates, 0 if there are none
+    uint64_t total_bytes; // Size of all files in the list, from the stat() of the directory walk
+    FileNode *file_list; // Linked list for all matched files
+    FileNode *file_list_tail; // Last node of file_list for constant time appends
+    unsigned int file_count;
+    // The file list can still grow (-T) while the compression workers consume it
+    pthread_mutex_t list_lock;
+    pthread_cond_t list_changed;
+    bool list_complete;
+    bool paths_stripped; // A leading '/' or ".." was removed from a path, reported once
+} Options;
+
+#if HAVE_IO_URING
+// Minimal io_uring instance, set up without liburing
+typedef struct
+{
+    int fd;
+    unsigned int sq_entries;
+    unsigned int queued; // Entries prepared and not submitted yet
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} IoRing;
+
+// One file of an io_uring read batch
+typedef struct
+{
+    FileNode *node;
+    int fd;
+    struct statx stx;
+    unsigned char *data;
+    size_t len;
+} ReadAheadSlot;
+#endif
+
+// Pool of equally sized, page aligned buffers shared by all threads. Buffers are handed back to the pool instead
+// of being freed, so in the steady state nothing is allocated per file
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t buffer_size;
+    void **free_buffers;
+    size_t free_count;
+    size_t free_capacity;
+} BufferPool;
+
+// Source of the data blocks of a file being archived: the io_uring read-ahead data or the file itself, read
+// region by region with SEEK_DATA/SEEK_HOLE when it is sparse
+typedef struct
+{
+    FILE *file; // NULL when the data was read ahead
+    const unsigned char *data;
+    uint64_t pos;
+    uint64_t size; // From fstat(), or the length of the read-ahead data
+    bool sparse;
+    uint64_t region_end; // End of the current data region of a sparse file
+} BlockReader;
+
+// Block of a large file streamed by the archive writer. The writer reads it, the workers (or the writer itself)
+// compress it, and the writer writes it to the archive in order
+typedef struct
+{
+    unsigned char *data; // DATA_BLOCK_SIZE bytes
+    unsigned char *compressed; // compressBound(DATA_BLOCK_SIZE) bytes
+    uint32_t len;
+    uint32_t stored_len; // Length of the stored block, equal to len if it is kept uncompressed
+    uint64_t hole_len; // A hole of a sparse file instead of data, nothing to compress
+    bool done;
+} StreamSlot;
+
+// Shared state of mdarc_archive_files() and its compression workers, protected by opts->list_lock
+typedef struct
+{
+    Options *opts;
+    FileNode *last_claimed; // Last node taken by a worker, NULL before the first one
+    FileNode *last_written; // Last node done by the writer, NULL before the first one
+    unsigned int in_flight; // Entries taken by workers and not yet written to the archive
+    unsigned int max_in_flight;
+    bool use_read_ahead; // Workers wait for the io_uring reader before taking an entry
+#if HAVE_IO_URING
+    IoRing ring;
+    FileNode *last_read; // Last node taken by the io_uring reader
+    unsigned int read_ahead; // Entries read ahead and not yet taken by a worker
+#endif
+    // Ring of blocks of the file being streamed. The counters only grow, slot = counter % stream_capacity
+    StreamSlot *stream_slots;
+    unsigned int stream_capacity;
+    uint64_t stream_read; // Blocks read by the writer
+    uint64_t stream_taken; // Blocks taken for compression
+    uint64_t stream_written; // Blocks written to the archive, only used by the writer
+    bool writer_done; // Nothing more will be streamed, the workers can exit once the list is handed out
+    BufferPool block_pool; // DATA_BLOCK_SIZE buffers for reading files
+    BufferPool payload_pool; // First payload buffer of every file, large enough for one compressed block
+#if HAVE_IO_URING
+    BufferPool read_pool; // Read-ahead buffers of the io_uring reader
+#endif
+    uint64_t memory_used; // Bytes held in data buffers and payloads, counted against opts->max_memory
+    uint64_t memory_peak;
+    uint64_t stream_min_size; // STREAM_MIN_SIZE, lower if a payload that large would not fit into --max-memory
+    unsigned int stream_slot_count; // Size of the stream ring, smaller with --max-memory
+    uint64_t worker_memory; // Part of --max-memory for the entries behind the one the writer needs next
+} CompressQueue;
+
+// Archive file being written or read front to back. offset counts the bytes passed so far, so entry positions
+// are known without ftell(), which does not work on pipes
+typedef struct
+{
+    FILE *file;
+    uint64_t offset;
+    bool seekable;
+} ArchiveStream;
+
+// Root table record of the index, one for every index block
+typedef struct
+{
+    uint64_t offset; // Archive offset of the deflated block
+    uint32_t stored_len;
+    uint32_t original_len;
+    uint32_t entry_count;
+    char *first_path; // Path of the first entry, the blocks are sorted by it
+} IndexBlock;
+
+// Entry of a loaded index block
+typedef struct
+{
+    uint64_t header_offset;
+    uint64_t original_size;
+    uint64_t compressed_size;
+    uint32_t checksum;
+    uint64_t list_index; // Position in the original file list
+    char *path; // Points into the paths of the loaded block
+} IndexEntry;
+
+// Index of a seekable archive. Opening it reads only the root table, an index block is read and inflated when an
+// entry in it is needed. One block is loaded at a time
+typedef struct
+{
+    ArchiveStream *in;
+    uint64_t entry_count;
+    uint32_t block_count;
+    IndexBlock *blocks;
+    uint32_t loaded; // Block held in entries, block_count if none is
+    IndexEntry *entries;
+    char *paths; // File paths of the loaded block, NUL terminated
+    unsigned char *data; // Inflated block
+    unsigned char *stored; // Block as stored in the archive
+    size_t entries_capacity;
+    size_t paths_capacity;
+    size_t data_capacity;
+    size_t stored_capacity;
+} ArchiveIndex;
+
+// File being extracted. The decode workers write its blocks with pwrite() at their offsets
+typedef struct
+{
+    int fd;
+    int tail_fd; // Second descriptor without O_DIRECT for the unaligned end of a direct file, -1 if not direct
+    uint64_t preallocated; // Size reserved with fallocate()
+    bool direct; // fd was opened with O_DIRECT, only whole multiples of DIRECT_IO_ALIGN can be written to it
+    bool sparse; // Holes are not written
+} OutputFile;
+
+typedef enum
+{
+    DECODE_EXTRACT, // Write the decoded entries to files
+    DECODE_TEST // Only decode and check the entries
+} DecodeMode;
+
+typedef struct
+{
+    uint32_t checksum;
+    uint32_t len;
+} DecodeBlock;
+
+// Entry being decoded. Put on the free list by release_entry() once the reader and all its blocks are done with it
+typedef struct DecodeEntry
+{
+    char file_path[MAX_PATH_LEN + 1];
+    OutputFile out; // fd is -1 when testing or if the file could not be created
+    uint64_t original_size;
+    uint32_t expected_checksum; // From the data descriptor
+    DecodeBlock *blocks; // Checksum of every block, combined in order when the entry is finished
+    size_t block_count;
+    size_t block_capacity;
+    unsigned int pending; // Blocks not decoded yet, plus one while the reader is still in the entry
+    const char *error; // First error of the entry, NULL if it is intact
+    struct DecodeEntry *next_free;
+} DecodeEntry;
+
+// Data block read from the archive and waiting for a decode worker
+typedef struct
+{
+    DecodeEntry *entry;
+    size_t block_index;
+    uint64_t offset; // Position of the block in the original file
+    uint32_t original_len;
+    uint32_t len;
+    unsigned char *data; // Slot buffer of compressBound(DATA_BLOCK_SIZE) bytes, aligned to DIRECT_IO_ALIGN
+} DecodeJob;
+
+typedef struct
+{
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t errors;
+} DecodeTotals;
+
+// Shared state of decode_archive() and its decode workers. Everything, including the entries, is protected by lock
+typedef struct
+{
+    DecodeMode mode;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    DecodeJob *jobs; // Ring buffer of queued blocks
+    size_t capacity;
+    size_t head;
+    size_t count;
+    bool reading_done;
+    DecodeTotals totals;
+    DecodeEntry *free_entries; // Released entries, reused with their block arrays for the next entries
+} DecodeQueue;
+
+typedef struct
+{
+    DecodeQueue *queue;
+    pthread_t thread;
+    unsigned char *spare; // Swapped with the buffer of the slot taken from the queue
+    unsigned char *block; // Decompressed block, aligned to DIRECT_IO_ALIGN
+    z_stream inflate_state;
+    z_stream *stream; // Reused for every block, NULL if it could not be set up
+} DecodeWorker;
+
+// Archive member searched by grep. A worker collects its matching lines, grep_parallel() prints them in order
+typedef struct
+{
+    char *file_path;
+    uint64_t header_offset;
+    char *output; // Matching lines, formatted as "member:line\n"
+    size_t output_len;
+    size_t output_capacity;
+    bool matched;
+    bool failed;
+    bool done;
+} GrepEntry;
+
+// Shared state of grep_parallel() and its search workers, protected by lock
+typedef struct
+{
+    Options *opts;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    GrepEntry *entries;
+    size_t entry_count;
+    size_t next; // Next member to be claimed by a worker
+    size_t printed; // Members already printed, the workers stay at most max_ahead members ahead
+    size_t max_ahead;
+} GrepQueue;
+
+typedef struct
+{
+    GrepQueue *queue;
+    pthread_t thread;
+    ArchiveStream in; // Every worker reads the archive through its own stream
+    unsigned char *block;
+    unsigned char *compressed_block;
+    z_stream inflate_state;
+    z_stream *stream; // Reused for every block, NULL if it could not be set up
+    char *carry; // Start of a line that continues in the next block
+    size_t carry_len;
+    size_t carry_capacity;
+    const char *pattern;
+    size_t pattern_len;
+    bool use_regex;
+    regex_t regex;
+} GrepWorker;
+
+// Directories created while extracting, a hash set of paths with open descriptors for the recently used ones
+typedef struct
+{
+    char *path; // NULL for an empty slot
+    size_t len;
+    int fd; // -1 if the descriptor is not open (anymore)
+} DirCacheEntry;
+
+typedef struct
+{
+    DirCacheEntry *entries;
+    size_t capacity; // Always a power of 2
+    size_t count;
+    unsigned int open_fds;
+} DirCache;
+
+// Phases timed by --stats
+typedef enum
+{
+    STAT_WALK, // Listing the files: wildcards, directory traversal, -T list
+    STAT_OPEN, // Opening and stat'ing input files
+    STAT_READ_FILES,
+    STAT_CHECKSUM,
+    STAT_COMPRESS,
+    STAT_WRITE_ARCHIVE,
+    STAT_READ_ARCHIVE,
+    STAT_INFLATE,
+    STAT_MKDIR,
+    STAT_CREATE, // Creating and preallocating extracted files
+    STAT_WRITE_FILES,
+    STAT_PHASES
+} StatPhase;
+
+// Totals of one phase, summed over all threads with relaxed atomic adds
+typedef struct
+{
+    uint64_t ns;
+    uint64_t calls;
+    uint64_t bytes;
+} PhaseStats;
+
+// Span recorded by --trace, start and end on the mdarc_stats_clock() clock
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+    const char *name; // Phase or stage, a string constant
+    char label[TRACE_LABEL_LEN]; // Entry the thread was working on, empty if none
+} TraceEvent;
+
+// Ring of the --trace events of one thread. Only its own thread writes to it, so recording needs no lock or atomic;
+// mdarc_write_trace() reads the rings after all threads are joined
+typedef struct TraceBuffer
+{
+    TraceEvent *events; // TRACE_RING_SIZE events
+    uint64_t count; // Events recorded so far, the last one is at (count - 1) % TRACE_RING_SIZE
+    unsigned int tid;
+    bool in_use; // Held by a running thread, otherwise free for the next thread to take over
+    char name[32];
+    char label[TRACE_LABEL_LEN]; // Current entry, copied into the next events
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+// --progress reporter thread of mdarc_archive_files()
+typedef struct
+{
+    Options *opts;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool done;
+    uint64_t start; // mdarc_stats_clock() when archiving started
+} ProgressReporter;
+
+// Archive being written through the library. A thread runs write_archive() on opts, which takes the entries
+// while they are added to its file list
+struct MdarcWriter
+{
+    Options opts;
+    CompressQueue queue; // Set up before the writer starts, entries added from memory are counted in it
+    FILE *archive;
+    pthread_t thread;
+    int result;
+};
+
+// Archive opened through the library. Entries are read from the index, next_block and next_entry are the position
+// of the entry mdarc_reader_next() returns next
+struct MdarcReader
+{
+    ArchiveStream in;
+    ArchiveIndex index;
+    uint32_t next_block;
+    uint32_t next_entry; // Position of the next entry in next_block
+    char path[MAX_PATH_LEN + 1];
+    unsigned char *block;
+    unsigned char *compressed_block;
+    z_stream inflate_state;
+    z_stream *stream; // NULL if it could not be set up, uncompress() is used then
+};
+
+// Physical location of a file, used to sort the file list for --read-order
+typedef struct
+{
+    FileNode *node;
+    dev_t device;
+    bool has_extent; // key is the disk position of the first extent, otherwise the inode number
+    uint64_t key;
+} FileLocation;
+
+// Engine entry points and helpers used by the command line program (mdarc.c). Everything else in libmdarc.c is
+// static, the library itself exports only these and the mdarc.h API
+int mdarc_archive_files(Options *opts);
+int mdarc_unarchive_files(Options *opts);
+int mdarc_test_archive(Options *opts);
+int mdarc_cat_archive(Options *opts);
+int mdarc_grep_archive(Options *opts);
+uint64_t mdarc_stats_clock(void);
+void mdarc_stats_add(StatPhase phase, uint64_t start, uint64_t calls, uint64_t bytes);
+void mdarc_print_stats(uint64_t start);
+void mdarc_trace_thread(const char *name);
+void mdarc_trace_span(const char *name, uint64_t start, uint64_t end);
+int mdarc_write_trace(const char *path, uint64_t start);
+int mdarc_expand_wildcards_and_add(const char *pattern, Options *opts);
+unsigned int mdarc_cpu_count(void);
+int mdarc_add_pattern(PatternList *list, const char *pattern);
+void mdarc_free_opts(Options *opts);
+
+// --stats, --trace and --progress switches, set by the command line program
+extern bool mdarc_stats_enabled;
+extern bool mdarc_trace_enabled;
+extern bool mdarc_progress_enabled;
+
+#endif
@@ -0,0 +1,70 @@
+#!/bin/sh
+# Extraction path test. Archives files given with "..", "." and empty path components and checks that they are
+# stored below the extraction directory and extract there. Then builds an archive whose entries have such paths
+# (archive written with safe names of the same length, patched afterwards) and checks that unarchive reports and
+# skips them and creates nothing outside the extraction directory. Exits with status 1 if a check fails.
+#
+#   make test
+#   TEST_DIR=/mnt/scratch make test      work directory, default /tmp/mdarc-test
+
+set -e
+
+MDARC=${MDARC:-$(pwd)/mdarc}
+TEST_DIR=${TEST_DIR:-/tmp/mdarc-test}
+
+fail()
+{
+    echo "FAIL: $1"
+    exit 1
+}
+
+rm -rf "$TEST_DIR"
+mkdir -p "$TEST_DIR/src/in/sub" "$TEST_DIR/src/in/aa" "$TEST_DIR/src/in/sub/aa/aa" "$TEST_DIR/src/in/sub/a" \
+    "$TEST_DIR/src/in/subx" "$TEST_DIR/out/x/y"
+cd "$TEST_DIR/src/in"
+echo outside > ../evilfile
+echo inside > sub/file
+echo safe > safe
+
+# Archiving strips the leading ".." and the "." and empty components, like tar, and the archive extracts
+"$MDARC" archive clean.arc ../evilfile sub/./file sub//file ./safe > /dev/null 2> "$TEST_DIR/errors"
+grep -q "removing leading '/' and '..'" "$TEST_DIR/errors" || fail "stripping .. was not reported"
+cd "$TEST_DIR/out/x/y"
+"$MDARC" unarchive "$TEST_DIR/src/in/clean.arc" > /dev/null || fail "unarchive failed on an archive made from ../"
+[ "$(cat evilfile)" = outside ] || fail "../evilfile was not extracted as evilfile"
+[ "$(cat sub/file)" = inside ] || fail "sub/./file was not extracted as sub/file"
+rm -rf evilfile sub safe
+
+# Entries with unsafe paths: written with safe names of the same length, which are then replaced in the entry
+# headers. unarchive reads the entries front to back, the index still has the safe names
+cd "$TEST_DIR/src/in"
+echo outside > aa/evilfile
+echo outside > sub/aa/aa/evilfile
+echo inside > sub/a/file
+echo inside > subx/file
+"$MDARC" archive unsafe.arc aa/evilfile sub/aa/aa/evilfile sub/a/file subx/file safe > /dev/null
+LC_ALL=C sed -i -e 's|sub/aa/aa/evilfile|sub/../../evilfile|' -e 's|aa/evilfile|../evilfile|' \
+    -e 's|sub/a/file|sub/./file|' -e 's|subx/file|sub//file|' unsafe.arc
+
+# Extracting must fail for the unsafe entries and still extract the safe one
+cd "$TEST_DIR/out/x/y"
+if "$MDARC" unarchive "$TEST_DIR/src/in/unsafe.arc" 2> "$TEST_DIR/errors"; then
+    fail "unarchive succeeded with unsafe paths in the archive"
+fi
+for path in ../evilfile sub/../../evilfile sub/./file sub//file; do
+    grep -q "unsafe file path in archive, skipping $path\$" "$TEST_DIR/errors" || fail "$path was not reported"
+done
+[ "$(cat safe)" = safe ] || fail "safe was not extracted"
+
+# Only the safe file may exist, in the extraction directory itself
+created=$(find "$TEST_DIR/out" -type f)
+[ "$created" = "$TEST_DIR/out/x/y/safe" ] || fail "files created outside the extraction directory: $created"
+
+# The same from stdin
+rm -f safe
+cat "$TEST_DIR/src/in/unsafe.arc" | "$MDARC" unarchive - 2> /dev/null && fail "unarchive - succeeded with unsafe paths"
+created=$(find "$TEST_DIR/out" -type f)
+[ "$created" = "$TEST_DIR/out/x/y/safe" ] || fail "files created outside the extraction directory from stdin: $created"
+
+rm -rf "$TEST_DIR"
+echo "unsafe paths: OK"